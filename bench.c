@@ -0,0 +1,542 @@
+/* benchmark driver: runs workloads through er's core against generated files */
+#define main ermain
+#include "er.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* corpus sizes */
+enum
+{
+	Smallsize = 1 << 20,  /* kept in a gap buffer */
+	Largesize = 64 << 20, /* kept in a piece table */
+	Utfsize   = 16 << 20,
+	Longsize  = 32 << 20,
+	Longlines = 512
+};
+
+typedef struct Corpus Corpus;
+typedef struct Work Work;
+
+/* generated input file */
+struct Corpus
+{
+	const char *name;
+	void       (*gen)(FILE *f);
+};
+
+/* benchmark workload */
+struct Work
+{
+	const char *name;
+	void       (*setup)(void); /* untimed key script, if any */
+	void       (*keys)(void);  /* timed key script (or NULL to call scan) */
+	int        (*scan)(void);  /* timed loop, returning operations done */
+};
+
+char                    dir[PATH_MAX / 2], file[PATH_MAX];
+int                     report, usepty;
+Array                   script;
+size_t                  frames, nkeys, yanklen, scanned;
+unsigned long long      rng = 0x9e3779b97f4a7c15ULL;
+
+/* next pseudo-random number (xorshift) */
+unsigned long
+rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng >> 1;
+}
+
+/* write lines of random lower-case words */
+void
+genwords(FILE *f, size_t n, size_t linelen)
+{
+	size_t i, l, w;
+
+	for(i = l = 0; i < n; ){
+		if(l >= linelen && i + 1 < n){
+			fputc('\n', f);
+			i++;
+			l = 0;
+		}
+		for(w = 1 + rnd() % 9; w > 0 && i < n - 1; w--, i++, l++)
+			fputc('a' + rnd() % 26, f);
+		fputc(' ', f);
+		i++;
+		l++;
+	}
+	fputc('\n', f);
+}
+
+void
+gensmall(FILE *f)
+{
+	genwords(f, Smallsize, 60);
+}
+
+void
+genlarge(FILE *f)
+{
+	genwords(f, Largesize, 60);
+}
+
+void
+genlong(FILE *f)
+{
+	genwords(f, Longsize, Longsize / Longlines);
+}
+
+/* write lines mixing ASCII with two, three and four byte characters */
+void
+genutf(FILE *f)
+{
+	size_t i, l;
+	const char *s;
+	static const char *pool[] = {
+		"a", "e", "s", " ", " ", "\xc3\xa9", "\xc3\xbc", "\xd0\xb6",
+		"\xe4\xb8\xad", "\xe6\x96\x87", "\xe3\x81\x82", "\xf0\x9f\x98\x80"
+	};
+
+	for(i = l = 0; i < Utfsize; l++){
+		if(l == 40){
+			fputc('\n', f);
+			i++;
+			l = 0;
+		}
+		s = pool[rnd() % LEN(pool)];
+		fputs(s, f);
+		i += strlen(s);
+	}
+	fputc('\n', f);
+}
+
+/* append bytes to key script */
+void
+sadd(const char *s, size_t n)
+{
+	while(script.cap < script.len + n)
+		resize(&script);
+	memcpy((char *)script.data + script.len, s, n);
+	script.len += n;
+}
+
+/* append string to key script n times */
+void
+srep(const char *s, size_t n)
+{
+	while(n-- > 0)
+		sadd(s, strlen(s));
+}
+
+/* move to a line in the middle of the file */
+void
+middle(void)
+{
+	char tmp[32];
+
+	snprintf(tmp, sizeof(tmp), "g%zu\n", lineof(len()) / 2);
+	srep(tmp, 1);
+}
+
+void
+ktype(void)
+{
+	size_t i;
+
+	middle();
+	srep("i", 1);
+	for(i = 0; i < 200; i++)
+		sadd((i % 60 == 59) ? "\n" : &"etaoin shrdlu"[i % 13], 1);
+	srep("\x1b", 1);
+}
+
+void
+kpaste(void)
+{
+	size_t i;
+
+	middle();
+	srep("i\x1b[200~", 1);
+	for(i = 0; i < 4 << 20; i++)
+		sadd((i % 60 == 59) ? "\n" : &"etaoin shrdlu"[i % 13], 1);
+	srep("\x1b[201~\x1b", 1);
+}
+
+/* yank yanklen bytes of text and move to the middle of the file */
+void
+syank(void)
+{
+	size_t i;
+
+	while(ybuf.cap < yanklen)
+		resize(&ybuf);
+	for(i = 0; i < yanklen; i++)
+		((char *)ybuf.data)[i] = (i % 60 == 59) ? '\n' : "etaoin shrdlu"[i % 13];
+	ybuf.len = yanklen;
+	middle();
+}
+
+void
+kyank(void)
+{
+	srep("p", 1);
+}
+
+void
+kpage(void)
+{
+	srep("\x1b[6~", 200);
+}
+
+void
+ksearch(void)
+{
+	srep("szqxjv\n", 1);
+}
+
+void
+kreplace(void)
+{
+	srep("Mqu\n\x7fQU\n", 1);
+}
+
+void
+sundo(void)
+{
+	middle();
+	srep("x", 200);
+}
+
+void
+kundo(void)
+{
+	srep("u", 200);
+}
+
+void
+kwrite(void)
+{
+	srep("W", 1);
+}
+
+/* open file again and draw first screen */
+int
+sopen(void)
+{
+	bufunload(buf);
+	if(bufload(buf) == -1)
+		return -1;
+	repaint = refresh = 1;
+	display();
+	frames++;
+	return 1;
+}
+
+/* step forward through every character */
+int
+snext(void)
+{
+	size_t i;
+	int n;
+
+	for(i = 0, n = 0; i < len(); n++)
+		next(&i);
+	return n;
+}
+
+/* step backward through every character */
+int
+sprev(void)
+{
+	size_t i;
+	int n;
+
+	for(i = len(), n = 0; i > 0; n++)
+		prev(&i);
+	return n;
+}
+
+/* find every match of the search pattern, counting the searches */
+int
+sfind(void)
+{
+	size_t i, so, eo;
+	int n;
+
+	for(i = 0, n = 1; i < len() && find(i, len(), &so, &eo) == 0; n++)
+		i = (eo > so) ? eo : so + 1;
+	scanned = len();
+	return n;
+}
+
+/* search for a plain string, scanning spans in place */
+int
+slit(void)
+{
+	setpat("zqxjv");
+	return sfind();
+}
+
+/* search for the same string through the regex engine */
+int
+sregex(void)
+{
+	setpat("zqxj[v]");
+	return sfind();
+}
+
+/* write key script to a file to be read as keys */
+int
+load(void (*f)(void))
+{
+	char path[PATH_MAX];
+
+	script.len = 0;
+	f();
+	snprintf(path, sizeof(path), "%s/keys", dir);
+	if((keyfd = creat(path, 0666)) == -1 ||
+	   writeall(keyfd, script.data, script.len) == -1 ||
+	   close(keyfd) == -1 || (keyfd = open(path, O_RDONLY)) == -1)
+		return -1;
+	ringr = ringw = 0;
+	return 0;
+}
+
+/* feed loaded keys through the editor as run() does, counting keys and frames */
+int
+drive(void)
+{
+	int k;
+
+	status = Ok;
+	if(sigsetjmp(env, 1) == 0){
+		repaint = 1;
+		for(;;){
+			if(refresh){
+				display();
+				refresh = 0;
+				frames++;
+			}
+			k = key();
+			nkeys++;
+			if(mode == Input)
+				input(k);
+			else
+				command(k);
+		}
+	}
+	close(keyfd);
+	return (status == Eof) ? 0 : -1;
+}
+
+/* send standard output to a pseudo-terminal, forking a process to read the
+ * other side as a terminal would; returns a pipe on which it gives the number
+ * of bytes read once the terminal is closed */
+int
+ptyopen(void)
+{
+	struct termios t;
+	static char c[1 << 16];
+	long long n;
+	ssize_t r;
+	int m, s, p[2];
+
+	if((m = posix_openpt(O_RDWR | O_NOCTTY)) == -1 || grantpt(m) == -1 ||
+	   unlockpt(m) == -1 || (s = open(ptsname(m), O_RDWR | O_NOCTTY)) == -1 ||
+	   tcgetattr(s, &t) == -1 || pipe(p) == -1)
+		return -1;
+	t.c_oflag &= ~OPOST; /* count bytes as er writes them */
+	if(tcsetattr(s, TCSANOW, &t) == -1)
+		return -1;
+	switch(fork()){
+	case -1:
+		return -1;
+	case 0:
+		close(s);
+		close(p[0]);
+		for(n = 0; (r = read(m, c, sizeof(c))) > 0 || (r == -1 && errno == EINTR); )
+			n += (r > 0) ? r : 0;
+		writeall(p[1], (char *)&n, sizeof(n));
+		_exit(0);
+	}
+	close(m);
+	close(p[1]);
+	if(dup2(s, STDOUT_FILENO) == -1)
+		return -1;
+	close(s);
+	return p[0];
+}
+
+/* run workload on corpus in a fresh process, reporting its costs */
+void
+bench(const Work *w, const char *corpus)
+{
+	char out[256], rate[32], *paths[1];
+	struct rusage ru;
+	double t;
+	long long o;
+	int n, pid, fd, scr;
+
+	if((pid = fork()) != 0){
+		if(pid != -1)
+			waitpid(pid, NULL, 0);
+		return;
+	}
+	snprintf(file, sizeof(file), "%s/%s", dir, corpus);
+	paths[0] = file;
+	init(1, paths);
+	if(arrinit(&script, 1) == -1)
+		_exit(1);
+	buf = bufat(0);
+	mode = Command;
+	refresh = usetabs = tabspace = autoindent = 1;
+	if(w->setup != NULL && (load(w->setup) == -1 || drive() == -1))
+		_exit(1);
+	if(w->keys != NULL && load(w->keys) == -1)
+		_exit(1);
+	o = lseek(STDOUT_FILENO, 0, SEEK_END);
+	fd = scr = -1;
+	if(usepty && ((scr = dup(STDOUT_FILENO)) == -1 || (fd = ptyopen()) == -1))
+		_exit(1);
+	frames = nkeys = scanned = 0;
+	t = now();
+	if(w->keys == NULL)
+		n = w->scan();
+	else
+		n = (drive() == -1) ? -1 : (int)nkeys;
+	while(buf->saver != 0)
+		savepoll(buf, 1);
+	t = now() - t;
+	if(usepty){ /* hang up, then hear how much the terminal read */
+		if(dup2(scr, STDOUT_FILENO) == -1 || read(fd, &o, sizeof(o)) != sizeof(o))
+			_exit(1);
+		wait(NULL);
+	}else
+		o = lseek(STDOUT_FILENO, 0, SEEK_END) - o;
+	getrusage(RUSAGE_SELF, &ru);
+	snprintf(rate, sizeof(rate), (scanned > 0) ? "%.0f" : "-", scanned / t / 1e6);
+	if(n <= 0)
+		snprintf(out, sizeof(out), "%-8s %-6s failed\n", w->name, corpus);
+	else
+		snprintf(out, sizeof(out), "%-8s %-6s %9d %12.1f %10.0f %8zu %10ld %8s\n",
+		         w->name, corpus, n, t * 1e9 / n,
+		         (frames > 0) ? (double)o / frames : 0.0, frames, ru.ru_maxrss, rate);
+	writeall(report, out, strlen(out));
+	jdrop(buf);
+	_exit(0);
+}
+
+int
+main(void)
+{
+	char path[PATH_MAX], name[16], *tmp;
+	size_t i, j;
+	long long huge;
+	Work w;
+	FILE *f;
+	int sink;
+	static const Corpus corpora[] = {
+		{ "small", gensmall },
+		{ "large", genlarge },
+		{ "utf8",  genutf },
+		{ "long",  genlong }
+	};
+	static const Work works[] = {
+		{ "open",    NULL,  NULL,     sopen },
+		{ "next",    NULL,  NULL,     snext },
+		{ "prev",    NULL,  NULL,     sprev },
+		{ "type",    NULL,  ktype,    NULL },
+		{ "paste",   NULL,  kpaste,   NULL },
+		{ "page",    NULL,  kpage,    NULL },
+		{ "search",  NULL,  ksearch,  NULL },
+		{ "litscan", NULL,  NULL,     slit },
+		{ "regscan", NULL,  NULL,     sregex },
+		{ "replace", NULL,  kreplace, NULL },
+		{ "undo",    sundo, kundo,    NULL },
+		{ "write",   NULL,  kwrite,   NULL }
+	};
+	static const Work ptyworks[] = {
+		{ "ptypage", NULL,  kpage,    NULL },
+		{ "ptytype", NULL,  ktype,    NULL }
+	};
+	static const size_t yanks[] = { 1 << 10, 1 << 14, 1 << 17, 1 << 20, 10 << 20, 100 << 20 };
+
+	tmp = getenv("TMPDIR");
+	snprintf(dir, sizeof(dir), "%s/erbench.%ld", (tmp != NULL) ? tmp : "/tmp", (long)getpid());
+	if(mkdir(dir, 0700) == -1){
+		perror(dir);
+		return 1;
+	}
+	for(i = 0; i < LEN(corpora); i++){
+		snprintf(path, sizeof(path), "%s/%s", dir, corpora[i].name);
+		if((f = fopen(path, "w")) == NULL){
+			perror(path);
+			return 1;
+		}
+		corpora[i].gen(f);
+		fclose(f);
+	}
+	/* ERBENCH_HUGE gives the size in GiB of a sparse file, words followed
+	 * by a hole, to open through the read window */
+	huge = (getenv("ERBENCH_HUGE") != NULL) ? atoll(getenv("ERBENCH_HUGE")) : 0;
+	snprintf(path, sizeof(path), "%s/huge", dir);
+	if(huge > 0 && ((f = fopen(path, "w")) == NULL ||
+	   (gensmall(f), fflush(f) == EOF) || ftruncate(fileno(f), huge << 30) == -1)){
+		perror(path);
+		return 1;
+	}
+	if(huge > 0)
+		fclose(f);
+	/* the screen goes to a file, so its size is the bytes written */
+	snprintf(path, sizeof(path), "%s/screen", dir);
+	printf("%-8s %-6s %9s %12s %10s %8s %10s %8s\n",
+	       "work", "corpus", "ops", "ns/op", "bytes/frm", "frames", "maxrss/KiB", "MB/s");
+	fflush(stdout);
+	report = dup(STDOUT_FILENO);
+	if((sink = creat(path, 0666)) == -1 || dup2(sink, STDOUT_FILENO) == -1){
+		perror(path);
+		return 1;
+	}
+	headless = 1;
+	dim.ws_col = 80;
+	dim.ws_row = 24;
+	for(i = 0; i < LEN(works); i++){
+		for(j = 0; j < LEN(corpora); j++)
+			bench(&works[i], corpora[j].name);
+	}
+	for(i = 0; i < LEN(yanks); i++){ /* p of a yank of each size */
+		yanklen = yanks[i];
+		snprintf(name, sizeof(name), (yanklen < 1 << 20) ? "p%zuK" : "p%zuM",
+		         yanklen >> ((yanklen < 1 << 20) ? 10 : 20));
+		w.name = name;
+		w.setup = syank;
+		w.keys = kyank;
+		w.scan = NULL;
+		for(j = 0; j < 2; j++)
+			bench(&w, corpora[j].name);
+	}
+	if(huge > 0)
+		bench(&works[0], "huge");
+	usepty = 1; /* the screen goes to a terminal, which counts it */
+	for(i = 0; i < LEN(ptyworks); i++){
+		for(j = 0; j < 2; j++)
+			bench(&ptyworks[i], corpora[j].name);
+	}
+	usepty = 0;
+	for(i = 0; i < LEN(corpora); i++){
+		snprintf(path, sizeof(path), "%s/%s", dir, corpora[i].name);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/huge", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/screen", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/keys", dir);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <poll.h>
 #include <regex.h>
 #include <setjmp.h>
 #include <signal.h>
@@ -14,9 +15,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -27,11 +32,81 @@
 #	define CTRL(X) ((X) & 0x1F)
 #endif
 
+/* byte vectors for the scanning kernels, widest the target allows */
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#	define Vlen        32
+#	define vset(c)     _mm256_set1_epi8(c)
+#	define vload(p)    _mm256_loadu_si256((const __m256i *)(p))
+#	define vcmp(v, w)  _mm256_cmpeq_epi8(v, w)
+#	define veq(v, w)   ((unsigned)_mm256_movemask_epi8(vcmp(v, w)))
+#	define vzero()     _mm256_setzero_si256()
+#	define vsub(v, w)  _mm256_sub_epi8(v, w)
+#	define vsad(v)     _mm256_sad_epu8(v, vzero())
+#	define vsum(v)     ((size_t)_mm256_extract_epi64(vsad(v), 0) + _mm256_extract_epi64(vsad(v), 1) + \
+	                    _mm256_extract_epi64(vsad(v), 2) + _mm256_extract_epi64(vsad(v), 3))
+typedef __m256i Vec;
+#elif defined(__SSE2__)
+#	include <emmintrin.h>
+#	define Vlen        16
+#	define vset(c)     _mm_set1_epi8(c)
+#	define vload(p)    _mm_loadu_si128((const __m128i *)(p))
+#	define vcmp(v, w)  _mm_cmpeq_epi8(v, w)
+#	define veq(v, w)   ((unsigned)_mm_movemask_epi8(vcmp(v, w)))
+#	define vzero()     _mm_setzero_si128()
+#	define vsub(v, w)  _mm_sub_epi8(v, w)
+#	define vsad(v)     _mm_sad_epu8(v, vzero())
+#	define vsum(v)     ((size_t)_mm_cvtsi128_si32(vsad(v)) + _mm_extract_epi16(vsad(v), 4))
+typedef __m128i Vec;
+#endif
+
+#ifndef PIECEMIN
+#	define PIECEMIN (1 << 24) /* smallest file kept in a piece table */
+#endif
+
+#ifndef UNDOMAX
+#	define UNDOMAX (64 << 20) /* default cap on undo memory per buffer */
+#endif
+
+#ifndef WINDOWMIN
+#	define WINDOWMIN ((size_t)1 << 30) /* smallest file read through a window */
+#endif
+
+#ifndef BUFMAX
+#	define BUFMAX (256 << 20) /* default memory budget for buffers read in */
+#endif
+
+/* latency instrumentation, compiled in with -DSTATS */
+#ifdef STATS
+#	define TALLY(p)     tally(p)
+#	define TALLYKEY()   tallykey()
+#	define TALLYOUT(n)  (st.out += (n))
+#	define TALLYFRAME() (st.frames++)
+#else
+#	define TALLY(p)
+#	define TALLYKEY()
+#	define TALLYOUT(n)
+#	define TALLYFRAME()
+#endif
+
 /* misc constants */
 enum
 {
-	Gaplen  = 256, /* number of bytes in a full gap */
-	Vbufmax = 4096 /* number of bytes in screen buffer */
+	Gaplen   = 256,     /* number of bytes in a full gap */
+	Blocklen = 16384,   /* number of bytes per line index block */
+	Scanlen  = 1 << 22, /* number of bytes searched between keyboard checks */
+	Hitmax   = 1 << 16, /* number of bytes searched for on-screen matches */
+	Hitrun   = 1 << 12, /* number of bytes a match in a long line may run past them */
+	Ringlen  = 1 << 16, /* number of bytes in input ring buffer */
+	Escms    = 100,     /* milliseconds to wait for rest of escape sequence */
+	Replyms  = 1000,    /* milliseconds to wait for terminal replies */
+	Jbatch   = 1 << 20, /* number of journal bytes held before writing */
+	Jsync    = 1,       /* seconds between journal fsyncs */
+	Blockmax = 1 << 16, /* number of line index blocks a file is built with */
+	Chunklen = 1 << 22, /* number of bytes in a window chunk */
+	Chunks   = 16,      /* number of window chunks held per buffer */
+	Colstep  = 1024,    /* characters between column checkpoints of a line */
+	Collines = 64       /* lines with column checkpoints kept per buffer */
 };
 
 /* error handling status */
@@ -39,7 +114,8 @@ enum
 {
 	Ok,
 	Panic, /* Unrecoverable errors */
-	Reset  /* Recoverable errors */
+	Reset, /* Recoverable errors */
+	Eof    /* End of key script */
 };
 
 /* keyboard keys */
@@ -56,7 +132,8 @@ enum
 	Kend,
 	Kpgup,
 	Kpgdown,
-	Kins
+	Kins,
+	Kpaste  /* bracketed paste, text in kbuf */
 };
 
 /* editing mode */
@@ -67,6 +144,20 @@ enum
 	Select
 };
 
+/* buffer storage engine */
+enum
+{
+	Gap,    /* contiguous contents with movable gap */
+	Pieces  /* piece table over original file and add buffer */
+};
+
+/* piece source */
+enum
+{
+	Orig,
+	Add
+};
+
 /* undo stack type */
 enum
 {
@@ -75,16 +166,84 @@ enum
 	Uend     /* sentinel for sequence of changes */
 };
 
+/* cell attribute flags (above an SGR colour) */
+enum
+{
+	Arev   = 0x100, /* reverse video */
+	Aunder = 0x200  /* underline */
+};
+
+/* search pattern kind */
+enum
+{
+	Pnone,
+	Plit,   /* plain string */
+	Pregex  /* extended regular expression */
+};
+
+#ifdef STATS
+/* phase of handling a key */
+enum
+{
+	Pkey,   /* reading and parsing */
+	Pcmd,   /* command or input */
+	Pline,  /* keeping lead address on screen */
+	Pdraw,  /* display */
+	Pall,   /* sum of the above */
+	Pn
+};
+
+enum
+{
+	Histlen = 128 /* latency histogram buckets, a quarter octave each */
+};
+
+typedef struct Stats Stats;
+
+/* latency statistics */
+struct Stats
+{
+	double             cur[Pn];           /* phase times of current key */
+	double             mark;              /* end of last phase */
+	short              busy;              /* a key is being handled */
+	unsigned long      hist[Pn][Histlen]; /* phase times of all keys */
+	double             max[Pn];
+	unsigned long      keys, frames;
+	unsigned long long out;               /* bytes written to terminal */
+};
+#endif
+
 typedef struct Change Change;
 typedef struct Array Array;
+typedef struct Piece Piece;
+typedef struct Block Block;
+typedef struct Chunk Chunk;
+typedef struct Mark Mark;
+typedef struct Cols Cols;
 typedef struct Buffer Buffer;
+typedef struct Hit Hit;
+typedef struct Cell Cell;
 
 /* textual change */
 struct Change
 {
 	short  type; /* undo stack type */
 	size_t i;    /* byte offset of change */
-	char   c;    /* value of change */
+	size_t n;    /* number of bytes changed */
+	size_t off;  /* offset of deleted bytes in undo arena */
+};
+
+/* character cell of screen */
+struct Cell
+{
+	char  c[8]; /* glyph, UTF-8 encoded (empty for right half of wide one) */
+	short attr; /* SGR colour, with attribute flags */
+};
+
+/* match of search pattern */
+struct Hit
+{
+	size_t so, eo; /* byte offsets of start and end */
 };
 
 /* dynamic array */
@@ -96,29 +255,124 @@ struct Array
 	size_t cap;   /* capacity */
 };
 
+/* span of original file or add buffer, as a node of a treap */
+struct Piece
+{
+	Piece    *l, *r; /* children */
+	unsigned prio;   /* heap priority */
+	short    src;    /* piece source */
+	size_t   off, n; /* span within source */
+	size_t   sum;    /* bytes in subtree */
+};
+
+/* run of text tallied by line index */
+struct Block
+{
+	size_t n;  /* bytes */
+	size_t nl; /* newlines (once counted) */
+};
+
+/* piece of original file read in (large-file mode) */
+struct Chunk
+{
+	size_t        off;  /* file offset */
+	char          *p;   /* Chunklen bytes */
+	unsigned long used; /* when last looked at */
+};
+
+/* place in a line */
+struct Mark
+{
+	size_t off; /* byte offset */
+	size_t n;   /* characters before it in the line */
+	size_t col; /* display columns before it in the line */
+};
+
+/* column checkpoints of a long line */
+struct Cols
+{
+	size_t        start; /* offset of line */
+	Array         marks; /* every Colstep characters, offsets from its start */
+	unsigned long used;  /* when last looked at */
+};
+
 /* editing buffer */
 struct Buffer
 {
-	char   *c;                  /* contents */
-	char   path[PATH_MAX];      /* filename */
-	Array  changes;             /* undo stack */
-	short  dirty;               /* modified flag */
-	size_t *lead, addr1, addr2; /* selection offsets */
-	size_t cap, gap, start;     /* gap book-keeping */
-	size_t vstart, vline;       /* display book-keeping */
+	short       kind;                /* storage engine */
+	char        *c;                  /* contents (Gap) */
+	char        *orig;               /* original file (Pieces) */
+	size_t      osize;               /* length of original file */
+	short       mapped;              /* original file is memory-mapped */
+	int         ofd;                 /* original file read through window, or -1 */
+	Array       window;              /* its chunks read in */
+	Array       add;                 /* append-only additions (Pieces) */
+	Piece       *root;               /* piece table (Pieces) */
+	char        *path;               /* filename */
+	short       loaded;              /* file read in */
+	unsigned long used;              /* when last switched to */
+	Array       changes;             /* undo stack */
+	Array       undobytes;           /* undo arena of deleted bytes */
+	Array       redo, redobytes;     /* redo stack and its arena */
+	short       trimmed;             /* oldest undo history evicted */
+	Array       blocks, fen;         /* line index and its Fenwick tree */
+	size_t      blocklen;            /* bytes per line index block */
+	size_t      counted;             /* leading blocks with newlines counted */
+	Array       cols;                /* column checkpoints of long lines */
+	short       dirty;               /* modified flag */
+	size_t      *lead, addr1, addr2; /* selection offsets */
+	size_t      cap, gap, start;     /* gap book-keeping */
+	size_t      vstart, vline;       /* display book-keeping */
+	const char  *sp;                 /* last span looked up */
+	size_t      s0, s1;              /* offsets covered by last span */
+	unsigned long edits;             /* changes made so far */
+	pid_t       saver;               /* process writing a snapshot, or 0 */
+	int         savefd;              /* its progress pipe */
+	size_t      savelen, saved;      /* bytes it is writing and has written */
+	unsigned long saveedits;         /* changes made before its snapshot */
+	double      savet;               /* when it started */
+	size_t      savejoff;            /* journal length at its snapshot */
+	int         jfd;                 /* journal of changes, or -1 */
+	short       jerr;                /* journal unusable */
+	short       junsynced;           /* journal written but not synced */
+	Array       jbuf;                /* journal records not yet written */
+	size_t      jlen;                /* journal bytes written */
+	double      jsynct;              /* when journal was last synced */
+	unsigned long long jbase[3];     /* size, mtime and inode of file journalled */
 };
 
-Buffer                bufs[32], *buf;
-Array                 ybuf, bbuf, dbuf;
-char                  ch[5], vbuf[Vbufmax];
-size_t                vbuflen, current, nbuf;
+Array                 bufs;
+Buffer                *buf;
+Array                 ybuf, bbuf, dbuf, sbuf, pbuf, rbuf, hits;
+Array                 frame, shadow, vbuf, kbuf, pfds;
+Buffer                *shown;
+size_t                shownline;
+char                  ch[5];
+unsigned char         ring[Ringlen];
+size_t                ringr, ringw;
+size_t                current;
+unsigned long         uses, ticks;
 struct winsize        dim;
 jmp_buf               env;
 const char            invalid[] = "�";
-short                 mode, refresh, quit, usetabs, tabspace, autoindent;
+size_t                piecemin = PIECEMIN;
+size_t                windowmin = WINDOWMIN;
+short                 mode, refresh, quit, usetabs, tabspace, autoindent, typing;
+short                 redoing, repaint, syncout;
+short                 headless;
+int                   keyfd = STDIN_FILENO;
+size_t                undomax = UNDOMAX;
+size_t                bufmax = BUFMAX;
+short                 fsyncs = 1, recover, discard;
+regex_t               preg;
+short                 pat;
+size_t                origin;
 sigset_t              oset;
 volatile sig_atomic_t status;
 struct termios        term;
+#ifdef STATS
+Stats                 st;
+#endif
 
 /* convert logical byte offset to internal byte offset */
 size_t
@@ -135,6 +389,16 @@ err(int n)
 	siglongjmp(env, 1);
 }
 
+/* seconds elapsed on a monotonic clock */
+double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
 /* number of decimal digits */
 int
 digits(long v)
@@ -146,32 +410,215 @@ digits(long v)
 int
 dims(void)
 {
+	if(headless) /* virtual screen, set in main() */
+		return 0;
 	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &dim) == -1 || dim.ws_col == 0)
 		return -1;
 	return 0;
 }
 
-/* read a byte from STDIN (see terminit() for timeout) */
+/* expand allocated memory for dynamic array */
+void
+resize(Array *a)
+{
+	void *new;
+
+	new = realloc(a->data, a->size * 2 * a->cap);
+	if(new == NULL)
+		err(Panic);
+	a->data = new;
+	a->cap *= 2;
+}
+
+/* allocate memory for dynamic array */
 int
-readbyte(void)
+arrinit(Array *a, size_t size)
 {
-	int n;
-	unsigned char c;
+	a->data = calloc(Gaplen, size);
+	if(a->data == NULL)
+		return -1;
+	a->size = size;
+	a->len = 0;
+	a->cap = Gaplen;
+	return 0;
+}
 
-	if((n = read(STDIN_FILENO, &c, 1)) == -1){
-		if(errno == EINTR)
-			n = 0;
-		else
-			err(Panic);
+/* free memory for dynamic array */
+void
+arrfree(Array *a)
+{
+	free(a->data);
+}
+
+/* write contents of byte string to file */
+ssize_t
+writeall(int f, const char *s, size_t n)
+{
+	int w;
+	ssize_t r;
+
+	r = n;
+	while(n){
+		w = write(f, s, n);
+		if(w == -1){
+			if(errno == EINTR)
+				w = 0;
+			else
+				return -1;
+		}
+		s += w;
+		n -= w;
 	}
-	if(n == 0)
+	return r;
+}
+
+/* read whatever input is available into ring buffer, waiting up to ms
+ * milliseconds (or indefinitely if negative) for some to arrive */
+size_t
+refill(int ms)
+{
+	struct pollfd p = { keyfd, POLLIN, 0 };
+	size_t w, n;
+	ssize_t r;
+
+	if(poll(&p, 1, ms) <= 0)
+		return 0;
+	w = ringw % Ringlen;
+	n = Ringlen - (ringw - ringr);
+	if(n > Ringlen - w) /* contiguous free space */
+		n = Ringlen - w;
+	if((r = read(keyfd, ring + w, n)) == -1){
+		if(errno == EINTR || errno == EAGAIN)
+			return 0;
+		err(Panic);
+	}
+	if(r == 0 && headless && ms >= 0) /* script has no more of this key */
+		return 0;
+	if(r == 0) /* terminal has gone, or key script has ended */
+		err(headless ? Eof : Panic);
+	ringw += r;
+	return r;
+}
+
+/* next input byte, waiting up to ms milliseconds (or indefinitely if negative) */
+int
+getbyte(int ms)
+{
+	if(ringr == ringw && refill(ms) == 0)
 		return -1;
-	return c;
+	return ring[ringr++ % Ringlen];
+}
+
+/* next input byte, waiting for it */
+int
+readbyte(void)
+{
+	return getbyte(-1);
+}
+
+/* whether input is waiting to be read (never, for a key script, so that
+ * every key is drawn as if typed) */
+int
+pending(void)
+{
+	struct pollfd p = { keyfd, POLLIN, 0 };
+
+	if(headless)
+		return 0;
+	return ringr != ringw || poll(&p, 1, 0) > 0;
+}
+
+#ifdef STATS
+/* charge time since end of last phase to phase p of current key */
+void
+tally(int p)
+{
+	double t;
+
+	t = now();
+	st.cur[p] += t - st.mark;
+	st.mark = t;
+}
+
+/* histogram bucket of a duration */
+int
+bucket(double t)
+{
+	int b;
+
+	if(t < 1e-6)
+		return 0;
+	b = 1 + (int)(4 * log2(t * 1e6));
+	return (b < Histlen) ? b : Histlen - 1;
+}
+
+/* record phases of the key just handled, then wait for another */
+void
+tallykey(void)
+{
+	int p;
+
+	if(st.busy){
+		st.cur[Pall] = st.cur[Pkey] + st.cur[Pcmd] + st.cur[Pline] + st.cur[Pdraw];
+		for(p = 0; p < Pn; p++){
+			st.hist[p][bucket(st.cur[p])]++;
+			if(st.cur[p] > st.max[p])
+				st.max[p] = st.cur[p];
+		}
+		st.keys++;
+	}
+	memset(st.cur, 0, sizeof(st.cur));
+	if(ringr == ringw)
+		refill(-1);
+	st.mark = now();
+	st.busy = 1;
+}
+
+/* fraction f quantile of phase p in microseconds, to within a bucket */
+double
+quantile(int p, double f)
+{
+	unsigned long n;
+	double t;
+	int b;
+
+	for(b = 0, n = 0; b < Histlen - 1; b++){
+		if((n += st.hist[p][b]) > f * st.keys)
+			break;
+	}
+	t = pow(2, b / 4.0); /* upper end of bucket */
+	return (t < st.max[p] * 1e6) ? t : st.max[p] * 1e6;
+}
+
+/* write statistics to file */
+void
+statdump(const char *path)
+{
+	FILE *f;
+	int p, b;
+	static const char *name[] = { "key", "cmd", "line", "draw", "all" };
+
+	if((f = fopen(path, "w")) == NULL)
+		return;
+	fprintf(f, "# keys %lu frames %lu bytes %llu\n", st.keys, st.frames, st.out);
+	fprintf(f, "# phase p50 p99 max (microseconds)\n");
+	for(p = 0; p < Pn; p++)
+		fprintf(f, "%s %.1f %.1f %.1f\n", name[p],
+		        quantile(p, 0.5), quantile(p, 0.99), st.max[p] * 1e6);
+	fprintf(f, "# phase below-microseconds keys\n");
+	for(p = 0; p < Pn; p++){
+		for(b = 0; b < Histlen; b++){
+			if(st.hist[p][b] > 0)
+				fprintf(f, "%s %.1f %lu\n", name[p], pow(2, b / 4.0), st.hist[p][b]);
+		}
+	}
+	fclose(f);
 }
+#endif
 
 /* read a byte stream until a complete multibyte character is found */
 int
-decode(char first, int (*m1)(size_t*), int (*m2)(void), size_t *i, wchar_t *wc)
+decode(char first, int (*more)(void), wchar_t *wc)
 {
 	int n, r;
 	mbstate_t ps;
@@ -180,7 +627,7 @@ decode(char first, int (*m1)(size_t*), int (*m2)(void), size_t *i, wchar_t *wc)
 		memset(&ps, 0, sizeof(ps));
 		switch (mbrtowc(wc, ch, n, &ps)){
 		case (size_t)-2:
-			if((r = (m1 != NULL) ? m1(i) : m2()) == -1)
+			if((r = more()) == -1)
 				return -1;
 			ch[n] = r;
 			break;
@@ -197,11 +644,37 @@ decode(char first, int (*m1)(size_t*), int (*m2)(void), size_t *i, wchar_t *wc)
 int
 parsechar(char c)
 {
-	if(decode(c, NULL, readbyte, NULL, NULL) == -1)
+	if(decode(c, readbyte, NULL) == -1)
 		err(Reset);
 	return c;
 }
 
+/* read bracketed paste up to its end marker into paste buffer */
+void
+readpaste(void)
+{
+	static const char end[] = "\x1b[201~";
+	size_t m;
+	int c;
+
+	kbuf.len = 0;
+	for(m = 0; m < sizeof(end) - 1 && (c = readbyte()) != -1; ){
+		if(c == end[m]){
+			m++;
+			continue;
+		}
+		while(kbuf.cap < kbuf.len + m + 1)
+			resize(&kbuf);
+		memcpy((char *)kbuf.data + kbuf.len, end, m); /* false start of marker */
+		kbuf.len += m;
+		m = 0;
+		if(c == end[0])
+			m = 1;
+		else
+			((char *)kbuf.data)[kbuf.len++] = c;
+	}
+}
+
 /* get user input from keyboard */
 int
 key(void)
@@ -246,16 +719,26 @@ key(void)
 	if((k = readbyte()) == -1)
 		return -1;
 	if(k == Kesc){
-		if((l = readbyte()) != -1 && (m = readbyte()) != -1){
+		if((l = getbyte(Escms)) != '[' && l != 'O'){
+			if(l != -1) /* lone escape: leave the next key unread */
+				ringr--;
+			return Kesc;
+		}
+		if((m = getbyte(Escms)) != -1){
 			for(i = 0; i < LEN(vt); i++){
 				if(l == vt[i].a && m == vt[i].b && vt[i].c == -1)
 					return vt[i].out;
 			}
-			if((n = readbyte()) != -1){
+			if((n = getbyte(Escms)) != -1){
 				for(i = 0; i < LEN(vt); i++){
 					if(l == vt[i].a && m == vt[i].b && n == vt[i].c)
 						return vt[i].out;
 				}
+				if(l == '[' && m == '2' && n == '0' &&
+				   getbyte(Escms) == '0' && getbyte(Escms) == '~'){
+					readpaste();
+					return Kpaste;
+				}
 			}
 		}
 		return Kesc;
@@ -267,242 +750,1343 @@ key(void)
 	return parsechar(k);
 }
 
-/* length of current buffer */
+/* check if escape is the next key pressed, leaving any other unread */
+int
+escaped(void)
+{
+	size_t r;
+
+	if(!pending() || (ringr == ringw && refill(0) == 0) || ring[ringr % Ringlen] != Kesc)
+		return 0;
+	r = ringr;
+	if(key() == Kesc)
+		return 1;
+	if(ringw - r <= Ringlen) /* its bytes are still in the ring */
+		ringr = r;
+	return 0;
+}
+
+/* bytes in piece subtree */
 size_t
-len(void)
+psum(Piece *p)
 {
-	return buf->cap - buf->gap;
+	return (p == NULL) ? 0 : p->sum;
 }
 
-/* next byte in the current buffer */
-int
-nextbuf(size_t *i)
+/* length of current buffer */
+size_t
+len(void)
 {
-	return (*i == len()) ? -1 : buf->c[bufaddr((*i)++)];
+	return (buf->kind == Pieces) ? psum(buf->root) : buf->cap - buf->gap;
 }
 
-/* next character in the current buffer */
-int
-next(size_t *i)
+/* piece of current buffer holding offset (< len()), and the offset within it */
+Piece *
+pfind(size_t i, size_t *off)
 {
-	wchar_t wc;
+	Piece *p;
+	size_t k;
 
-	memset(ch, 0, 5);
-	if(decode(buf->c[bufaddr((*i)++)], nextbuf, NULL, i, &wc) == -1){
-		memcpy(ch, invalid, sizeof(invalid));
-		return 1;
+	p = buf->root;
+	for(;;){
+		k = psum(p->l);
+		if(i < k)
+			p = p->l;
+		else if(i < k + p->n)
+			break;
+		else{
+			i -= k + p->n;
+			p = p->r;
+		}
 	}
-	if(wc == '\t')
-		return 8;
-	if(wc == '\n')
-		return 1;
-	return wcwidth(wc);
+	*off = i - k;
+	return p;
 }
 
-/* end of line in current buffer */
-int
-eol(size_t *i)
+/* bytes of current buffer's original file from offset, reading in the chunk
+ * holding them over the least recently used one if need be; returns the
+ * number of them up to the end of the chunk */
+size_t
+chunk(size_t off, const char **s)
 {
-	int r;
+	Chunk *c, *lru;
+	size_t i, n;
+	ssize_t k;
 
-	r = 0;
-	if(*i < len()){
-		do{
-			next(i);
-			r++;
-		}while(*i < len() && buf->c[bufaddr(*i)] != '\n');
+	c = buf->window.data;
+	for(i = 0, lru = NULL; i < buf->window.len; i++){
+		if(off - c[i].off < Chunklen)
+			goto Found;
+		if(lru == NULL || c[i].used < lru->used)
+			lru = &c[i];
 	}
-	return r;
+	if(buf->window.len < Chunks){
+		if(buf->window.len == buf->window.cap)
+			resize(&buf->window);
+		lru = (Chunk *)buf->window.data + buf->window.len;
+		if((lru->p = malloc(Chunklen)) == NULL)
+			err(Panic);
+		buf->window.len++;
+		c = buf->window.data;
+	}
+	buf->s0 = buf->s1 = 0; /* at() may be looking into it */
+	lru->off = off - off % Chunklen;
+	n = (buf->osize - lru->off < Chunklen) ? buf->osize - lru->off : Chunklen;
+	for(i = 0; i < n; i += k){
+		k = pread(buf->ofd, lru->p + i, n - i, lru->off + i);
+		if(k == 0 || (k == -1 && errno != EINTR))
+			err(Panic); /* file was cut short under us */
+		if(k == -1)
+			k = 0;
+	}
+	i = lru - c;
+Found:
+	c[i].used = ++ticks;
+	*s = c[i].p + off - c[i].off;
+	n = c[i].off + Chunklen;
+	return ((n < buf->osize) ? n : buf->osize) - off;
 }
 
-/* previous character in current buffer */
-int
-prev(size_t *i)
+/* contiguous bytes of current buffer from offset, returning their number */
+size_t
+span(size_t i, const char **s)
 {
-	size_t m, n;
-	int r;
+	Piece *p;
+	size_t k;
 
-	n = r = 0;
-	if(*i > 0){
-		do{
-			n++;
-			m = *i - n;
-			r = next(&m);
-		}while(m > 0 && n < 4 && strncmp(ch, invalid, 5) == 0);
-		*i = (*i < n) ? 0 : *i - n;
+	if(i >= len())
+		return 0;
+	if(buf->kind == Gap){
+		*s = buf->c + bufaddr(i);
+		return (i < buf->start) ? buf->start - i : len() - i;
 	}
-	return r;
+	p = pfind(i, &i);
+	if(p->src == Orig && buf->ofd != -1){
+		k = chunk(p->off + i, s);
+		return (k < p->n - i) ? k : p->n - i;
+	}
+	*s = ((p->src == Orig) ? buf->orig : (char *)buf->add.data) + p->off + i;
+	return p->n - i;
 }
 
-/* start of line in current buffer */
-int
-sol(size_t *i)
+/* byte at offset in current buffer */
+char
+at(size_t i)
 {
-	int r;
+	const char *s;
+	size_t n;
 
-	r = 0;
-	if (*i > 0) {
-		do{
-			prev(i);
-			r++;
-		}while(*i > 0 && buf->c[bufaddr(*i)] != '\n');
+	if(buf->kind == Gap)
+		return (i < len()) ? buf->c[bufaddr(i)] : 0;
+	if(i < buf->s0 || i >= buf->s1){
+		if(i >= len())
+			return 0;
+		n = span(i, &s); /* before the window can forget the last one */
+		buf->s0 = i;
+		buf->s1 = i + n;
+		buf->sp = s;
 	}
-	return r;
+	return buf->sp[i - buf->s0];
 }
 
-/* next line in current buffer */
+/* copy bytes from current buffer */
 void
-nextline(size_t *i)
+bytes(char *s, size_t i, size_t n)
 {
-	size_t m, n;
+	const char *p;
+	size_t k;
 
-	m = *i;
-	n = sol(&m);
-	if(m > 0)
-		n--;
-	if(buf->c[bufaddr(*i)] != '\n')
-		eol(i);
-	if(*i < len() - 1){
-		next(i);
-		while(n && buf->c[bufaddr(*i)] != '\n' && *i < len() - 1){
-			next(i);
-			n--;
+	while(n > 0 && (k = span(i, &p)) > 0){
+		if(k > n)
+			k = n;
+		memcpy(s, p, k);
+		s += k;
+		i += k;
+		n -= k;
+	}
+}
+
+/* contiguous bytes of current buffer ending at offset, returning their number */
+size_t
+rspan(size_t i, const char **s)
+{
+	Piece *p;
+	size_t k;
+
+	if(i == 0 || i > len())
+		return 0;
+	if(buf->kind == Gap){
+		if(i > buf->start){
+			*s = buf->c + bufaddr(buf->start);
+			return i - buf->start;
 		}
+		*s = buf->c;
+		return i;
+	}
+	p = pfind(i - 1, &i);
+	if(p->src == Orig && buf->ofd != -1){
+		k = (p->off + i) % Chunklen; /* bytes before it in its chunk */
+		if(k > i)
+			k = i;
+		chunk(p->off + i - k, s);
+		return k + 1;
+	}
+	*s = ((p->src == Orig) ? buf->orig : (char *)buf->add.data) + p->off;
+	return i + 1;
+}
+
+/* number of bits set */
+int
+popcnt(unsigned m)
+{
+	m = m - ((m >> 1) & 0x55555555);
+	m = (m & 0x33333333) + ((m >> 2) & 0x33333333);
+	return (((m + (m >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+/* number of newlines in p (k bytes) */
+size_t
+memnl(const char *p, size_t k)
+{
+	const char *e;
+	size_t r;
+#ifdef Vlen
+	Vec nl, acc;
+	int j;
+
+	/* count in byte lanes, emptying them before they can overflow */
+	nl = vset('\n');
+	for(r = 0, e = p + k; e - p >= Vlen; ){
+		acc = vzero();
+		for(j = 0; j < 255 && e - p >= Vlen; j++, p += Vlen)
+			acc = vsub(acc, vcmp(vload(p), nl));
+		r += vsum(acc);
+	}
+#else
+	r = 0;
+	e = p + k;
+#endif
+	for(; p < e; p++)
+		r += (*p == '\n');
+	return r;
+}
+
+/* nth newline (n > 0) in p (k bytes), or NULL after subtracting those seen from n */
+const char *
+memnth(const char *p, size_t k, size_t *n)
+{
+	const char *e;
+#ifdef Vlen
+	Vec nl;
+	unsigned m;
+	size_t c;
+
+	nl = vset('\n');
+	for(e = p + k; e - p >= Vlen; p += Vlen){
+		if((m = veq(vload(p), nl)) == 0)
+			continue;
+		if((c = popcnt(m)) < *n){
+			*n -= c;
+			continue;
+		}
+		for(; *n > 1; (*n)--)
+			m &= m - 1;
+		return p + ffs(m) - 1;
+	}
+#else
+	e = p + k;
+#endif
+	for(; p < e && (p = memchr(p, '\n', e - p)) != NULL; p++){
+		if(--*n == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/* last newline in p (k bytes), or NULL */
+const char *
+memrnl(const char *p, size_t k)
+{
+	const char *e;
+#ifdef Vlen
+	Vec nl;
+	unsigned m;
+	int j;
+
+	nl = vset('\n');
+	for(e = p + k; e - p >= Vlen; e -= Vlen){
+		if((m = veq(vload(e - Vlen), nl)) != 0){
+			for(j = Vlen - 1; !(m >> j & 1); j--)
+				;
+			return e - Vlen + j;
+		}
+	}
+#else
+	e = p + k;
+#endif
+	while(e-- > p){
+		if(*e == '\n')
+			return e;
+	}
+	return NULL;
+}
+
+/* offset of nth newline (n > 0) in current buffer at or after offset (or its length) */
+size_t
+nthnl(size_t i, size_t n)
+{
+	const char *p, *q;
+	size_t k;
+
+	while((k = span(i, &p)) > 0){
+		if((q = memnth(p, k, &n)) != NULL)
+			return i + (q - p);
+		i += k;
+	}
+	return len();
+}
+
+/* offset of next newline in current buffer at or after offset (or its length) */
+size_t
+findnl(size_t i)
+{
+	return nthnl(i, 1);
+}
+
+/* first newline in current buffer from offset, or limit if there is none before it */
+size_t
+findnlto(size_t i, size_t lim)
+{
+	const char *p, *q;
+	size_t k;
+
+	while(i < lim && (k = span(i, &p)) > 0){
+		if(k > lim - i)
+			k = lim - i;
+		if((q = memchr(p, '\n', k)) != NULL)
+			return i + (q - p);
+		i += k;
+	}
+	return lim;
+}
+
+/* offset of last newline in current buffer before offset (or its length if none) */
+size_t
+rfindnl(size_t i)
+{
+	const char *p, *q;
+	size_t k;
+
+	while((k = rspan(i, &p)) > 0){
+		if((q = memrnl(p, k)) != NULL)
+			return i - k + (q - p);
+		i -= k;
+	}
+	return len();
+}
+
+/* display width of a character, cached for the BMP */
+int
+cwidth(wchar_t wc)
+{
+	static signed char tab[0x10000];
+
+	if(wc >= 0x10000)
+		return wcwidth(wc);
+	if(tab[wc] == 0)
+		tab[wc] = wcwidth(wc) + 2;
+	return tab[wc] - 2;
+}
+
+/* decode the UTF-8 sequence at offset into ch, returning its length */
+int
+utf8(size_t i, wchar_t *wc)
+{
+	unsigned char c;
+	int k, n;
+
+	c = at(i);
+	n = (c >= 0xc2 && c <= 0xdf) ? 2 : (c >= 0xe0 && c <= 0xef) ? 3 :
+		(c >= 0xf0 && c <= 0xf4) ? 4 : 0;
+	if(n == 0 || i + n > len())
+		return 0;
+	ch[0] = c;
+	*wc = c & (0x7f >> n);
+	for(k = 1; k < n; k++){
+		c = ch[k] = at(i + k);
+		if((c & 0xc0) != 0x80)
+			return 0;
+		*wc = (*wc << 6) | (c & 0x3f);
+	}
+	if((n == 3 && *wc < 0x800) || (n == 4 && *wc < 0x10000) ||
+	   *wc > 0x10ffff || (*wc >= 0xd800 && *wc <= 0xdfff))
+		return 0;
+	ch[n] = 0;
+	return n;
+}
+
+/* next character in the current buffer */
+int
+next(size_t *i)
+{
+	wchar_t wc;
+	unsigned char c;
+	int n;
+
+	if(*i >= len()){
+		ch[0] = 0;
+		return 0;
+	}
+	c = at(*i);
+	if(c < 0x80){
+		ch[0] = c;
+		ch[1] = 0;
+		(*i)++;
+		return (c == '\t') ? 8 : (c == '\n') ? 1 : cwidth(c);
+	}
+	if((n = utf8(*i, &wc)) == 0){
+		memcpy(ch, invalid, sizeof(invalid));
+		(*i)++;
+		return 1;
+	}
+	*i += n;
+	return cwidth(wc);
+}
+
+/* end of line in current buffer */
+void
+eol(size_t *i)
+{
+	if(*i < len()){
+		next(i);
+		*i = findnl(*i);
+	}
+}
+
+/* previous character in current buffer */
+int
+prev(size_t *i)
+{
+	size_t m, n;
+	wchar_t wc;
+
+	if(*i == 0)
+		return 0;
+	for(n = 1; n < 4 && n < *i && (at(*i - n) & 0xc0) == 0x80; n++)
+		;
+	m = *i - n;
+	if(n > 1 && utf8(m, &wc) != (int)n)
+		m = *i - 1;
+	*i = m;
+	return next(&m);
+}
+
+/* start of line in current buffer */
+void
+sol(size_t *i)
+{
+	size_t k;
+
+	if(*i > 0){
+		prev(i);
+		if(at(*i) != '\n')
+			*i = ((k = rfindnl(*i)) < len()) ? k : 0;
+	}
+}
+
+/* reposition current buffer's gap ready for insertion/deletion */
+void
+move(size_t i)
+{
+	size_t j, dst, src, num;
+
+	if(buf->gap == 0){
+		buf->start = i;
+		return;
+	}
+	j = bufaddr(i);
+	if(j != buf->start + buf->gap){
+		dst = (j < buf->start) ? j + buf->gap : buf->start;
+		src = (j < buf->start) ? j : buf->start + buf->gap;
+		num = (j < buf->start) ? buf->start - j : j - (buf->gap + buf->start);
+		memmove(buf->c + dst, buf->c + src, num);
+		buf->start = (j < buf->start) ? j : j - buf->gap;
+	}
+}
+
+/* append new item to the end of dynamic array */
+#define APPEND(A, T, E) do{                 \
+	if((A)->len == (A)->cap)            \
+		resize(A);                  \
+	((T *)(A)->data)[(A)->len++] = (E); \
+}while(0)
+
+/* memory held by current buffer's undo and redo history */
+size_t
+undomem(void)
+{
+	return sizeof(Change) * (buf->changes.len + buf->redo.len) +
+	       buf->undobytes.len + buf->redobytes.len;
+}
+
+/* evict oldest groups of undo history once current buffer exceeds its cap */
+void
+trim(void)
+{
+	Change *c;
+	size_t e, k, m, n;
+
+	if(undomem() <= undomax)
+		return;
+	c = buf->changes.data;
+	n = undomem();
+	for(k = e = 0; k < buf->changes.len; k++){
+		n -= sizeof(Change) + ((c[k].type == Udelete) ? c[k].n : 0);
+		if(c[k].type == Uend){
+			e = k + 1;
+			if(n <= undomax / 4 * 3) /* leave some headroom */
+				break;
+		}
+	}
+	if(e == 0)
+		return;
+	for(k = e; k < buf->changes.len && c[k].type != Udelete; k++)
+		;
+	m = (k < buf->changes.len) ? c[k].off : buf->undobytes.len;
+	memmove(buf->undobytes.data, (char *)buf->undobytes.data + m,
+	        buf->undobytes.len - m);
+	buf->undobytes.len -= m;
+	memmove(c, c + e, sizeof(Change) * (buf->changes.len - e));
+	buf->changes.len -= e;
+	for(k = 0; k < buf->changes.len; k++){
+		if(c[k].type == Udelete)
+			c[k].off -= m;
+	}
+	buf->trimmed = 1;
+}
+
+/* append new textual change to the current buffer's undo stack,
+ * coalescing it with the previous one where they are contiguous */
+void
+record(short t, size_t i, size_t n)
+{
+	Change *c, x = { t, i, n, 0 };
+
+	if(t != Uend && !redoing) /* a new edit discards what was undone */
+		buf->redo.len = buf->redobytes.len = 0;
+
+	c = (buf->changes.len > 0) ? (Change *)buf->changes.data + buf->changes.len - 1 : NULL;
+	if(t == Udelete){
+		while(buf->undobytes.cap < buf->undobytes.len + n)
+			resize(&buf->undobytes);
+		x.off = buf->undobytes.len;
+		bytes((char *)buf->undobytes.data + x.off, i, n);
+		buf->undobytes.len += n;
+	}
+	if(c == NULL && t == Uend)
+		return;
+	if(c != NULL && c->type == t){
+		switch(t){
+		case Uend:
+			return; /* no empty groups */
+		case Uinsert:
+			if(c->i + c->n != i)
+				break;
+			c->n += n;
+			return;
+		case Udelete:
+			if(c->i != i || c->off + c->n != x.off)
+				break;
+			c->n += n;
+			return;
+		}
+	}
+	APPEND(&buf->changes, Change, x);
+	if(t == Uend)
+		trim();
+}
+
+/* reopen last group on current buffer's undo stack if it ends with an insertion at offset */
+void
+reopen(size_t i)
+{
+	Change *c;
+
+	if(buf->changes.len >= 2){
+		c = (Change *)buf->changes.data + buf->changes.len - 2;
+		if(c[1].type == Uend && c[0].type == Uinsert && c[0].i + c[0].n == i)
+			buf->changes.len--;
+	}
+}
+
+/* path of buffer's journal: a hidden file beside it */
+int
+jpath(Buffer *b, char *path)
+{
+	const char *s;
+	int n;
+
+	s = strrchr(b->path, '/');
+	if(s == NULL)
+		n = snprintf(path, PATH_MAX, ".%s.erj", b->path);
+	else
+		n = snprintf(path, PATH_MAX, "%.*s/.%s.erj", (int)(s - b->path), b->path, s + 1);
+	return (n < PATH_MAX) ? 0 : -1;
+}
+
+/* add bytes to buffer's pending journal records */
+void
+jput(Buffer *b, const void *s, size_t n)
+{
+	while(b->jbuf.cap < b->jbuf.len + n)
+		resize(&b->jbuf);
+	memcpy((char *)b->jbuf.data + b->jbuf.len, s, n);
+	b->jbuf.len += n;
+}
+
+/* write buffer's pending journal records, starting the journal if need be;
+ * returns -1 if it has no usable journal */
+int
+jflush(Buffer *b)
+{
+	char path[PATH_MAX];
+
+	if(b->jerr)
+		return -1;
+	if(b->jbuf.len == 0)
+		return 0;
+	if(b->jfd == -1){
+		if(jpath(b, path) == -1 ||
+		   (b->jfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1 ||
+		   writeall(b->jfd, "erj1", 4) == -1 ||
+		   writeall(b->jfd, (char *)b->jbase, sizeof(b->jbase)) == -1)
+			goto Error;
+		b->jlen = 4 + sizeof(b->jbase);
+	}
+	if(writeall(b->jfd, b->jbuf.data, b->jbuf.len) == -1)
+		goto Error;
+	b->jlen += b->jbuf.len;
+	b->jbuf.len = 0;
+	b->junsynced = (fsyncs > 0);
+	return 0;
+Error:
+	b->jerr = 1;
+	return -1;
+}
+
+/* record change to current buffer in its journal: an insertion of the
+ * bytes s, or a deletion if s is NULL */
+void
+jlog(size_t i, size_t n, const char *s)
+{
+	unsigned long long v[2];
+
+	if(buf->jerr)
+		return;
+	v[0] = i;
+	v[1] = n;
+	jput(buf, (s != NULL) ? "i" : "d", 1);
+	jput(buf, v, sizeof(v));
+	if(s != NULL && n >= Jbatch){ /* write large text as it is */
+		if(jflush(buf) == -1)
+			return;
+		if(writeall(buf->jfd, s, n) == -1)
+			buf->jerr = 1;
+		buf->jlen += n;
+		return;
+	}
+	if(s != NULL)
+		jput(buf, s, n);
+	if(buf->jbuf.len >= Jbatch)
+		jflush(buf);
+}
+
+/* take file's identity as base of buffer's journal */
+void
+jrebase(Buffer *b, const struct stat *st)
+{
+	b->jbase[0] = st->st_size;
+	b->jbase[1] = st->st_mtime;
+	b->jbase[2] = st->st_ino;
+}
+
+/* sync buffer's journal to disk if it is due, returning seconds until it is */
+double
+jsync(Buffer *b, int force)
+{
+	double t;
+
+	if(!b->junsynced)
+		return -1;
+	t = b->jsynct + Jsync - now();
+	if(t > 0 && !force)
+		return t;
+	fsync(b->jfd);
+	b->junsynced = 0;
+	b->jsynct = now();
+	return -1;
+}
+
+/* forget buffer's journal */
+void
+jdrop(Buffer *b)
+{
+	char path[PATH_MAX];
+
+	if(b->jfd != -1){
+		close(b->jfd);
+		jpath(b, path);
+		unlink(path);
+	}
+	b->jfd = -1;
+	b->junsynced = 0;
+	b->jlen = b->jbuf.len = 0;
+}
+
+/* open current buffer's gap at offset, with room for at least n bytes */
+void
+grow(size_t i, size_t n)
+{
+	char *new;
+	size_t gap, tail;
+
+	move(i);
+	if(buf->gap >= n)
+		return;
+	gap = n + Gaplen + len() / 2; /* grow in proportion to buffer size */
+	tail = buf->cap - buf->start - buf->gap;
+	new = realloc(buf->c, len() + gap);
+	if(new == NULL)
+		err(Panic);
+	memmove(new + buf->start + gap, new + buf->start + buf->gap, tail);
+	buf->c = new;
+	buf->cap = len() + gap;
+	buf->gap = gap;
+}
+
+/* recompute book-keeping for piece */
+void
+pfix(Piece *p)
+{
+	p->sum = psum(p->l) + p->n + psum(p->r);
+}
+
+/* allocate new piece */
+Piece *
+pnew(short src, size_t off, size_t n)
+{
+	static unsigned seed = 2463534242u;
+	Piece *p;
+
+	p = calloc(1, sizeof(Piece));
+	if(p == NULL)
+		err(Panic);
+	seed ^= seed << 13; /* xorshift */
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	p->prio = seed;
+	p->src = src;
+	p->off = off;
+	p->n = p->sum = n;
+	return p;
+}
+
+/* free piece subtree */
+void
+pfree(Piece *p)
+{
+	if(p != NULL){
+		pfree(p->l);
+		pfree(p->r);
+		free(p);
+	}
+}
+
+/* join piece subtrees, all of a preceding all of b */
+Piece *
+pmerge(Piece *a, Piece *b)
+{
+	if(a == NULL)
+		return b;
+	if(b == NULL)
+		return a;
+	if(a->prio > b->prio){
+		a->r = pmerge(a->r, b);
+		pfix(a);
+		return a;
+	}
+	b->l = pmerge(a, b->l);
+	pfix(b);
+	return b;
+}
+
+/* split piece subtree into first i bytes and the remainder */
+void
+psplit(Piece *p, size_t i, Piece **a, Piece **b)
+{
+	Piece *q;
+	size_t k;
+
+	if(p == NULL){
+		*a = *b = NULL;
+		return;
+	}
+	k = psum(p->l);
+	if(i <= k){
+		psplit(p->l, i, a, &p->l);
+		pfix(p);
+		*b = p;
+	}else if(i >= k + p->n){
+		psplit(p->r, i - k - p->n, &p->r, b);
+		pfix(p);
+		*a = p;
+	}else{ /* split the piece itself */
+		q = pnew(p->src, p->off + i - k, p->n - (i - k));
+		p->n = i - k;
+		*b = pmerge(q, p->r);
+		p->r = NULL;
+		pfix(p);
+		*a = p;
+	}
+}
+
+/* extend last piece of subtree if it ends where the add buffer does */
+int
+pextend(Piece *p, size_t off, size_t n)
+{
+	if(p == NULL)
+		return 0;
+	if(p->r != NULL){
+		if(!pextend(p->r, off, n))
+			return 0;
+	}else if(p->src != Add || p->off + p->n != off)
+		return 0;
+	else
+		p->n += n;
+	p->sum += n;
+	return 1;
+}
+
+/* line index block */
+#define BLK(K) (((Block *)buf->blocks.data)[K])
+#define FEN(K) (((Block *)buf->fen.data)[K])
+
+/* number of newlines in range of current buffer */
+size_t
+countnl(size_t i, size_t n)
+{
+	const char *p;
+	size_t k, r;
+
+	r = 0;
+	while(n > 0 && (k = span(i, &p)) > 0){
+		if(k > n)
+			k = n;
+		r += memnl(p, k);
+		i += k;
+		n -= k;
+	}
+	return r;
+}
+
+/* add to line index totals of block k (negative values wrap around) */
+void
+ladd(size_t k, size_t n, size_t nl)
+{
+	for(k++; k <= buf->blocks.len; k += k & -k){
+		FEN(k).n += n;
+		FEN(k).nl += nl;
+	}
+}
+
+/* line index totals of first k blocks */
+Block
+lprefix(size_t k)
+{
+	Block r = { 0, 0 };
+
+	for(; k > 0; k -= k & -k){
+		r.n += FEN(k).n;
+		r.nl += FEN(k).nl;
+	}
+	return r;
+}
+
+/* rebuild Fenwick tree of line index from its blocks */
+void
+lrebuild(void)
+{
+	size_t j, k;
+
+	while(buf->fen.cap < buf->blocks.len + 1)
+		resize(&buf->fen);
+	memset(buf->fen.data, 0, sizeof(Block) * (buf->blocks.len + 1));
+	for(k = 1; k <= buf->blocks.len; k++){
+		FEN(k).n += BLK(k - 1).n;
+		FEN(k).nl += BLK(k - 1).nl;
+		if((j = k + (k & -k)) <= buf->blocks.len){
+			FEN(j).n += FEN(k).n;
+			FEN(j).nl += FEN(k).nl;
+		}
+	}
+}
+
+/* build line index for current buffer, leaving newlines to be counted */
+void
+lbuild(void)
+{
+	Block b = { 0, 0 };
+	size_t i;
+
+	buf->blocks.len = buf->counted = 0;
+	/* keep the index small for huge files, with fewer, larger blocks */
+	buf->blocklen = (len() / Blockmax > Blocklen) ? len() / Blockmax : Blocklen;
+	for(i = 0; i == 0 || i < len(); i += buf->blocklen){
+		b.n = (len() - i < buf->blocklen) ? len() - i : buf->blocklen;
+		APPEND(&buf->blocks, Block, b);
+	}
+	lrebuild();
+}
+
+/* count newlines in line index blocks of current buffer before block k */
+void
+lcount(size_t k)
+{
+	size_t i;
+
+	i = lprefix(buf->counted).n;
+	for(; buf->counted < k; buf->counted++){
+		BLK(buf->counted).nl = countnl(i, BLK(buf->counted).n);
+		ladd(buf->counted, 0, BLK(buf->counted).nl);
+		i += BLK(buf->counted).n;
+	}
+}
+
+/* line index block containing offset in current buffer, and where it starts */
+size_t
+lfind(size_t i, size_t *off)
+{
+	size_t bit, k, n;
+
+	if(buf->blocks.len == 0)
+		lbuild();
+	for(bit = 1; bit * 2 <= buf->blocks.len; bit *= 2)
+		;
+	for(k = n = 0; bit > 0; bit /= 2){
+		if(k + bit <= buf->blocks.len && n + FEN(k + bit).n <= i){
+			k += bit;
+			n += FEN(k).n;
+		}
+	}
+	if(k == buf->blocks.len)
+		n -= BLK(--k).n;
+	*off = n;
+	return k;
+}
+
+/* split oversized line index block k into blocks of standard size */
+void
+lsplit(size_t k)
+{
+	Block b;
+	size_t i, m, n;
+
+	n = BLK(k).n;
+	m = (n + buf->blocklen - 1) / buf->blocklen;
+	while(buf->blocks.cap < buf->blocks.len + m)
+		resize(&buf->blocks);
+	memmove(&BLK(k + m), &BLK(k + 1), sizeof(Block) * (buf->blocks.len - k - 1));
+	buf->blocks.len += m - 1;
+	i = lprefix(k).n;
+	for(; m > 0; m--, k++, i += b.n){
+		b.n = (n < buf->blocklen) ? n : buf->blocklen;
+		b.nl = (k < buf->counted) ? countnl(i, b.n) : 0;
+		n -= b.n;
+		BLK(k) = b;
+		if(k < buf->counted && m > 1)
+			buf->counted++;
 	}
+	lrebuild();
 }
 
-/* previous line in current buffer */
+/* update line index after n bytes were inserted at offset in current buffer */
 void
-prevline(size_t *i)
+lins(size_t i, size_t n)
 {
-	size_t n;
+	size_t k, nl, off;
 
-	if(*i > 0){
-		n = sol(i) - 1;
-		if (*i == 0)
-			return;
-		sol(i);
-		if(buf->c[bufaddr(*i)] == '\n')
-			next(i);
-		while(n && buf->c[bufaddr(*i)] != '\n' && *i < len() - 1){
-			next(i);
-			n--;
+	if(buf->blocks.len == 0)
+		return; /* not built yet */
+	k = lfind(i, &off);
+	nl = (k < buf->counted) ? countnl(i, n) : 0;
+	BLK(k).n += n;
+	BLK(k).nl += nl;
+	ladd(k, n, nl);
+	if(BLK(k).n > 2 * buf->blocklen)
+		lsplit(k);
+}
+
+/* update line index before n bytes are deleted at offset in current buffer */
+void
+ldel(size_t i, size_t n)
+{
+	size_t c, j, k, m, nl, off;
+	int empty;
+
+	if(buf->blocks.len == 0)
+		return;
+	for(k = lfind(i, &off), empty = 0; n > 0 && k < buf->blocks.len; k++){
+		m = off + BLK(k).n - i;
+		if(m > n)
+			m = n;
+		nl = (k < buf->counted) ? countnl(i, m) : 0;
+		off += BLK(k).n;
+		BLK(k).n -= m;
+		BLK(k).nl -= nl;
+		ladd(k, -m, -nl);
+		empty |= BLK(k).n == 0;
+		i += m;
+		n -= m;
+	}
+	if(!empty)
+		return;
+	for(j = k = 0, c = buf->counted; k < buf->blocks.len; k++){ /* drop emptied blocks */
+		if(BLK(k).n > 0 || (j == 0 && k == buf->blocks.len - 1))
+			BLK(j++) = BLK(k);
+		else if(k < c)
+			buf->counted--;
+	}
+	if(j < buf->blocks.len){
+		buf->blocks.len = j;
+		lrebuild();
+	}
+}
+
+/* line number of offset in current buffer */
+size_t
+lineof(size_t i)
+{
+	size_t k, off;
+
+	if(i > len())
+		i = len();
+	k = lfind(i, &off);
+	lcount(k);
+	return lprefix(k).nl + countnl(off, i - off);
+}
+
+/* offset of start of line in current buffer (or its length if there is none) */
+size_t
+linestart(size_t l)
+{
+	size_t bit, k, n, nl;
+
+	if(l == 0)
+		return 0;
+	if(buf->blocks.len == 0)
+		lbuild();
+	while(buf->counted < buf->blocks.len && lprefix(buf->counted).nl < l)
+		lcount(buf->counted + 1);
+	for(bit = 1; bit * 2 <= buf->blocks.len; bit *= 2)
+		;
+	for(k = n = nl = 0; bit > 0; bit /= 2){
+		if(k + bit <= buf->counted && nl + FEN(k + bit).nl < l){
+			k += bit;
+			n += FEN(k).n;
+			nl += FEN(k).nl;
 		}
 	}
+	if(k == buf->blocks.len)
+		return len();
+	return nthnl(n, l - nl) + 1;
 }
 
-/* check if displayed subset of current buffer needs to be updated */
-int
-checkline(int dir)
+/* column checkpoints of current buffer's line starting at offset, made if asked
+ * in place of the least recently used if need be (or NULL) */
+Cols *
+cols(size_t s, int make)
 {
-	int n, r;
-	size_t i;
+	Cols *c, *lru;
+	Mark m;
+	size_t k;
 
-	n = 1;
-	r = 0;
-	if(dir){
-		for(i = buf->vstart; i < buf->addr2; i++){
-			if (buf->c[bufaddr(i)] == '\n')
-				n++;
+	c = buf->cols.data;
+	for(k = 0, lru = NULL; k < buf->cols.len; k++){
+		if(c[k].start == s){
+			c[k].used = ++ticks;
+			return &c[k];
 		}
-		r = n;
-		n -= dim.ws_row - 1;
-		while(n-- > 0){
-			nextline(&buf->vstart);
-			buf->vline++;
+		if(lru == NULL || c[k].used < lru->used)
+			lru = &c[k];
+	}
+	if(!make)
+		return NULL;
+	if(buf->cols.len < Collines){
+		if(buf->cols.len == buf->cols.cap)
+			resize(&buf->cols);
+		lru = (Cols *)buf->cols.data + buf->cols.len;
+		if(arrinit(&lru->marks, sizeof(Mark)) == -1)
+			err(Panic);
+		buf->cols.len++;
+	}
+	lru->start = s;
+	lru->used = ++ticks;
+	lru->marks.len = 0;
+	m.off = m.n = m.col = 0;
+	APPEND(&lru->marks, Mark, m);
+	return lru;
+}
+
+/* walk line of current buffer starting at offset from its nearest column
+ * checkpoint, to the character at offset lim->off, the lim->n'th or the one
+ * spanning column lim->col, whichever comes first, or else the end of the
+ * line; leaves that place in lim */
+void
+colwalk(size_t s, Mark *lim)
+{
+	Cols *c;
+	Mark m, *mk;
+	size_t k, lo, hi;
+	int w;
+
+	m.off = s;
+	m.n = m.col = 0;
+	if((c = cols(s, 0)) != NULL){
+		mk = c->marks.data;
+		for(lo = 0, hi = c->marks.len; hi - lo > 1; ){
+			k = lo + (hi - lo) / 2;
+			if(s + mk[k].off <= lim->off && mk[k].n <= lim->n && mk[k].col <= lim->col)
+				lo = k;
+			else
+				hi = k;
 		}
-	}else{
-		while(buf->addr1 < buf->vstart){
-			prevline(&buf->vstart);
-			buf->vline--;
+		m = mk[lo];
+		m.off += s;
+	}
+	while(m.off < lim->off && m.n < lim->n && m.off < len()){
+		k = m.off;
+		if((w = next(&k)) < 0) /* unprintable */
+			w = 0;
+		if(ch[0] == '\n' || m.col + w > lim->col)
+			break;
+		m.off = k;
+		m.n++;
+		m.col += w;
+		if(m.n % Colstep == 0){
+			if(c == NULL)
+				c = cols(s, 1);
+			if(m.n / Colstep == c->marks.len){
+				m.off -= s;
+				APPEND(&c->marks, Mark, m);
+				m.off += s;
+			}
 		}
 	}
-	return r;
+	*lim = m;
 }
 
-/* reposition current buffer's gap ready for insertion/deletion */
+/* keep column checkpoints of current buffer in step with n bytes
+ * inserted (or deleted) at offset */
 void
-move(size_t i)
+coledit(size_t i, size_t n, int del)
 {
-	size_t j, dst, src, num;
+	Cols *c;
+	Mark *mk;
+	size_t k;
 
-	j = bufaddr(i);
-	if(j != buf->start + buf->gap){
-		dst = (j < buf->start) ? j + buf->gap : buf->start;
-		src = (j < buf->start) ? j : buf->start + buf->gap;
-		num = (j < buf->start) ? buf->start - j : j - (buf->gap + buf->start);
-		memmove(buf->c + dst, buf->c + src, num);
-		buf->start = (j < buf->start) ? j : j - buf->gap;
+	c = buf->cols.data;
+	for(k = 0; k < buf->cols.len; ){
+		if(c[k].start > i && del && c[k].start <= i + n){ /* joined to line before */
+			arrfree(&c[k].marks);
+			c[k] = c[--buf->cols.len];
+			continue;
+		}
+		if(c[k].start > i)
+			c[k].start = del ? c[k].start - n : c[k].start + n;
+		else{ /* characters up to a few bytes before may now decode differently */
+			mk = c[k].marks.data;
+			while(c[k].marks.len > 1 && c[k].start + mk[c[k].marks.len - 1].off + 4 > i)
+				c[k].marks.len--;
+		}
+		k++;
 	}
 }
 
-/* expand allocated memory for dynamic array */
+/* move offset in current buffer from the start of its line to the given column */
 void
-resize(Array *a)
+column(size_t *i, size_t n)
 {
-	void *new;
+	Mark m;
 
-	new = realloc(a->data, a->size * 2 * a->cap);
-	if(new == NULL)
-		err(Panic);
-	a->data = new;
-	a->cap *= 2;
+	m.off = (len() > 0) ? len() - 1 : 0;
+	m.n = n;
+	m.col = (size_t)-1;
+	colwalk(*i, &m);
+	*i = m.off;
 }
 
-/* append new item to the end of dynamic array */
-#define APPEND(A, T, E) do{                 \
-	if((A)->len == (A)->cap)            \
-		resize(A);                  \
-	((T *)(A)->data)[(A)->len++] = (E); \
-}while(0)
+/* place of offset in its line in current buffer */
+Mark
+place(size_t i)
+{
+	Mark m;
+
+	m.off = i;
+	m.n = m.col = (size_t)-1;
+	colwalk(linestart(lineof(i)), &m);
+	return m;
+}
+
+/* number of characters preceding offset in its line */
+size_t
+col(size_t i)
+{
+	return place(i).n;
+}
 
-/* append new textual change to the current buffer's undo stack */
+/* move offset in current buffer by n lines, keeping its column */
 void
-record(short t, size_t i, char c) {
-	Change x = { t, i, c };
-	APPEND(&buf->changes, Change, x);
+lines(size_t *i, long n)
+{
+	size_t c, l, k;
+
+	l = lineof(*i);
+	if(n < 0 && l < (size_t)-n){
+		*i = 0;
+		return;
+	}
+	c = col(*i);
+	k = linestart(l + n);
+	if(n > 0 && k >= len()){ /* no such line: go to end of last one */
+		*i = findnl(linestart(lineof((len() > 0) ? len() - 1 : 0)));
+		return;
+	}
+	*i = k;
+	column(i, c);
+}
+
+/* next line in current buffer */
+void
+nextline(size_t *i)
+{
+	lines(i, 1);
 }
 
-/* reallocate memory for current buffer's gap */
+/* previous line in current buffer */
 void
-grow(void)
+prevline(size_t *i)
 {
-	char *new;
+	lines(i, -1);
+}
 
-	new = realloc(buf->c, (buf->cap + Gaplen));
-	if(new == NULL)
-		err(Panic);
-	buf->c = new;
-	buf->start = buf->cap;
-	buf->gap = Gaplen;
-	buf->cap += Gaplen;
+/* scroll display of current buffer to start at line */
+void
+view(size_t l)
+{
+	buf->vstart = linestart(l);
+	buf->vline = lineof(buf->vstart);
 }
 
-/* insert byte into current buffer, optionally recording on undo stack */
+/* check if displayed subset of current buffer needs to be updated */
 void
-insert(size_t i, char c, int r)
+checkline(int dir)
 {
-	if(buf->gap == 0)
-		grow(); /* please mind the gap */
-	move(i);
-	buf->c[buf->start++] = c;
-	buf->gap--;
+	size_t l;
+
+	TALLY(Pcmd);
+	if(dir){
+		l = lineof(buf->addr2);
+		if(l + 2 > buf->vline + dim.ws_row)
+			view(l + 2 - dim.ws_row);
+	}else if(buf->addr1 < buf->vstart)
+		view(lineof(buf->addr1));
+	TALLY(Pline);
+}
+
+/* make room for n bytes at offset in current buffer, returning where to write them */
+char *
+reserve(size_t i, size_t n)
+{
+	if(buf->kind == Gap){
+		grow(i, n); /* please mind the gap */
+		return buf->c + buf->start;
+	}
+	while(buf->add.cap < buf->add.len + n)
+		resize(&buf->add);
+	return (char *)buf->add.data + buf->add.len;
+}
+
+/* insert n bytes written to reserved space, optionally recording on undo stack */
+void
+commit(size_t i, size_t n, int r)
+{
+	Piece *a, *b;
+
+	jlog(i, n, (buf->kind == Gap) ? buf->c + buf->start : (char *)buf->add.data + buf->add.len);
+	if(buf->kind == Gap){
+		buf->start += n;
+		buf->gap -= n;
+	}else{
+		psplit(buf->root, i, &a, &b);
+		if(!pextend(a, buf->add.len, n))
+			a = pmerge(a, pnew(Add, buf->add.len, n));
+		buf->root = pmerge(a, b);
+		buf->add.len += n;
+	}
+	buf->s0 = buf->s1 = 0;
+	lins(i, n);
+	coledit(i, n, 0);
 	buf->dirty = 1;
+	buf->edits++;
 	if(r)
-		record(Uinsert, i, 0);
+		record(Uinsert, i, n);
 }
 
-/* delete byte from current buffer, optionally recording on undo stack */
+/* insert bytes into current buffer, optionally recording on undo stack */
 void
-delete(size_t i, int r)
+insert(size_t i, const char *s, size_t n, int r)
 {
-	char c;
+	if(n > 0){
+		memcpy(reserve(i, n), s, n);
+		commit(i, n, r);
+	}
+}
 
-	move(i);
-	c = buf->c[buf->start + buf->gap++];
-	buf->dirty = 1;
+/* insert n copies of a byte into current buffer */
+void
+fill(size_t i, char c, size_t n, int r)
+{
+	if(n > 0){
+		memset(reserve(i, n), c, n);
+		commit(i, n, r);
+	}
+}
+
+/* delete bytes from current buffer, optionally recording on undo stack */
+void
+delete(size_t i, size_t n, int r)
+{
+	Piece *a, *b, *c;
+
+	if(n == 0)
+		return;
 	if(r)
-		record(Udelete, i, c);
+		record(Udelete, i, n);
+	jlog(i, n, NULL);
+	ldel(i, n);
+	coledit(i, n, 1);
+	if(buf->kind == Gap){
+		move(i);
+		buf->gap += n;
+	}else{
+		psplit(buf->root, i, &a, &b);
+		psplit(b, n, &c, &b);
+		pfree(c);
+		buf->root = pmerge(a, b);
+	}
+	buf->s0 = buf->s1 = 0;
+	buf->dirty = 1;
+	buf->edits++;
 }
 
 /* (de/in)dent selected lines in current buffer */
@@ -515,30 +2099,28 @@ indent(size_t *a, size_t *b, int fwd)
 	i = *a;
 	if(i > 0){
 		sol(&i);
-		if(buf->c[bufaddr(i)] == '\n' && i < len() - 1)
+		if(at(i) == '\n' && i < len() - 1)
 			next(&i);
 	}
 	while(i <= *b && i < len() - 1){
-		k = tabspace;
-		while(k-- > 0){
-			if(fwd){
-				if(i <= *a)
-					(*a)++;
-				insert(i, usetabs ? '\t' : ' ', 1);
-				(*b)++;
-			}else{
-				if(len() > 0 && i < len() &&
-				   buf->c[bufaddr(i)] == (usetabs ? '\t' : ' ')){
-					delete(i, 1);
-					if(i < *a)
-						(*a)--;
-					(*b)--;
-				}
+		if(fwd){
+			if(i <= *a)
+				*a += tabspace;
+			fill(i, usetabs ? '\t' : ' ', tabspace, 1);
+			*b += tabspace;
+		}else{
+			for(k = 0; k < tabspace && i + k < len(); k++){
+				if(at(i + k) != (usetabs ? '\t' : ' '))
+					break;
 			}
+			delete(i, k, 1);
+			if(i < *a)
+				*a -= (*a - i < (size_t)k) ? *a - i : (size_t)k;
+			*b -= (*b - i < (size_t)k) ? *b - i : (size_t)k;
 		}
-		if(buf->c[bufaddr(i)] != '\n')
+		if(at(i) != '\n')
 			eol(&i);
-		if(buf->c[bufaddr(i)] == '\n' && i < len() - 1)
+		if(at(i) == '\n' && i < len() - 1)
 			next(&i);
 	}
 	record(Uend, 0, 0);
@@ -548,21 +2130,24 @@ indent(size_t *a, size_t *b, int fwd)
 void
 newline(size_t *a, int O)
 {
-	size_t b;
+	size_t b, n;
 
 	b = *a;
 	if(O && *a == 0){
-		insert(0, '\n', 1);
+		insert(0, "\n", 1, 1);
 		return;
 	}
-	insert((*a)++, '\n', 1);
+	n = 0;
 	if(autoindent){
 		sol(&b);
-		if(buf->c[bufaddr(b)] == '\n' && b < len())
+		if(at(b) == '\n' && b < len())
 			next(&b);
-		while(buf->c[bufaddr(b++)] == (usetabs ? '\t' : ' ') && b < len())
-			insert((*a)++, usetabs ? '\t' : ' ', 1);
+		while(b + n < *a && at(b + n) == (usetabs ? '\t' : ' '))
+			n++;
 	}
+	insert((*a)++, "\n", 1, 1);
+	fill(*a, usetabs ? '\t' : ' ', n, 1);
+	*a += n;
 }
 
 /* attempt to open file and read contents into buffer */
@@ -577,19 +2162,53 @@ fileinit(Buffer *b)
 
 	fd = -1;
 	n = 0;
-	if((fd = open(b->path, O_RDWR | O_CREAT, 0666)) > 0 && fstat(fd, &st) != -1)
+	if((fd = open(b->path, O_RDWR | O_CREAT, 0666)) > 0 && fstat(fd, &st) != -1){
 		n = st.st_size;
-	b->c = calloc(n + Gaplen, 1);
-	if(b->c != NULL){
+		jrebase(b, &st);
+	}
+	b->kind = (n >= piecemin) ? Pieces : Gap;
+	b->c = b->orig = NULL;
+	b->osize = n;
+	b->mapped = 0;
+	b->ofd = -1;
+	b->window.data = NULL;
+	b->window.len = 0;
+	b->root = NULL;
+	b->s0 = b->s1 = 0;
+	if(b->kind == Pieces && n >= windowmin && arrinit(&b->window, sizeof(Chunk)) != -1){
+		/* larger than memory, perhaps: keep a window of chunks read in */
+		b->ofd = fd;
+		b->root = pnew(Orig, 0, n);
+		return 0;
+	}
+	if(b->kind == Pieces && n > 0){
+		/* zero-copy: pages are only read in when displayed or searched */
+		p = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED){
+			b->orig = p;
+			b->mapped = 1;
+			b->root = pnew(Orig, 0, n);
+			close(fd);
+			return 0;
+		}
+	}
+	if(b->kind == Pieces)
+		p = b->orig = malloc(n + 1);
+	else
+		p = b->c = calloc(n + Gaplen, 1);
+	if(p != NULL){
 		b->cap = n + Gaplen;
 		b->start = n;
 		b->gap = Gaplen;
+		if(b->kind == Pieces && n > 0)
+			b->root = pnew(Orig, 0, n);
 		if(fd > 0){
-			p = b->c;
 			while(n){
 				k = read(fd, p, n);
 				if(k == -1){
 					free(b->c);
+					free(b->orig);
+					pfree(b->root);
 					close(fd);
 					return -1;
 				}
@@ -655,82 +2274,375 @@ Error:
 	exit(1);
 }
 
-/* set terminal into raw mode */
+/* set terminal into raw mode */
+void
+terminit(void)
+{
+	struct termios new;
+
+	if(tcgetattr(STDIN_FILENO, &new) != -1){
+		term = new;
+		new.c_iflag &= ~(BRKINT | ISTRIP | INLCR | INPCK | IXON);
+		new.c_oflag &= ~OPOST;
+		new.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		new.c_cflag |= CS8;
+		new.c_cc[VMIN] = 1; /* input is polled for, see refill() */
+		new.c_cc[VTIME] = 0;
+		if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &new) != -1){
+			(void)!write(STDOUT_FILENO, CSI("?2004h"), 8); /* bracketed paste */
+			return;
+		}
+	}
+	perror("terminit");
+	exit(1);
+}
+
+/* apply buffer's journal to it, if it was made against the file as it is */
+int
+jreplay(Buffer *b, const char *path)
+{
+	unsigned long long h[3], v[2];
+	char m[4], t;
+	Buffer *old;
+	Array a;
+	FILE *f;
+	long off;
+
+	if((f = fopen(path, "r")) == NULL)
+		return -1;
+	errno = ESTALE;
+	if(fread(m, 4, 1, f) != 1 || memcmp(m, "erj1", 4) != 0 ||
+	   fread(h, sizeof(h), 1, f) != 1 || memcmp(h, b->jbase, sizeof(h)) != 0 ||
+	   arrinit(&a, 1) == -1){
+		fclose(f);
+		return -1;
+	}
+	old = buf;
+	buf = b;
+	b->jerr = 1; /* replayed changes are in the journal already */
+	off = ftell(f);
+	while(fread(&t, 1, 1, f) == 1 && fread(v, sizeof(v), 1, f) == 1){
+		if(t == 'i' && v[0] <= len()){
+			while(a.cap < v[1])
+				resize(&a);
+			if(fread(a.data, 1, v[1], f) != v[1])
+				break;
+			insert(v[0], a.data, v[1], 0);
+		}else if(t == 'd' && v[0] + v[1] <= len())
+			delete(v[0], v[1], 0);
+		else
+			break;
+		off = ftell(f);
+	}
+	buf = old;
+	arrfree(&a);
+	fclose(f);
+	/* carry on from the last whole record */
+	if((b->jfd = open(path, O_RDWR)) == -1 || ftruncate(b->jfd, off) == -1 ||
+	   lseek(b->jfd, off, SEEK_SET) == -1)
+		return -1;
+	b->jlen = off;
+	b->jerr = 0;
+	return 0;
+}
+
+/* whether buffer's file has a journal left from an earlier session */
+int
+jexists(Buffer *b)
+{
+	char path[PATH_MAX];
+
+	return jpath(b, path) != -1 && access(path, F_OK) != -1;
+}
+
+/* set up journal of buffer, recovering changes from an earlier one */
+int
+jinit(Buffer *b)
+{
+	char path[PATH_MAX];
+
+	b->jfd = -1;
+	b->jerr = b->junsynced = 0;
+	b->jlen = 0;
+	b->jsynct = 0;
+	if(!jexists(b))
+		return 0;
+	if(discard && jpath(b, path) != -1)
+		return unlink(path);
+	if(recover && jpath(b, path) != -1)
+		return jreplay(b, path);
+	errno = EEXIST;
+	return -1;
+}
+
+/* start buffer's journal afresh against its newly written file,
+ * keeping only the changes made since the write began */
+void
+jrestart(Buffer *b)
+{
+	struct stat st;
+	size_t n;
+	Array a;
+
+	if(b->jerr)
+		return;
+	if(stat(b->path, &st) == -1){
+		b->jerr = 1;
+		return;
+	}
+	if(b->jlen + b->jbuf.len == b->savejoff){
+		jdrop(b);
+		jrebase(b, &st);
+		return;
+	}
+	if(jflush(b) == -1 || arrinit(&a, 1) == -1)
+		return;
+	if(b->savejoff < 4 + sizeof(b->jbase)) /* no journal when the write began */
+		b->savejoff = 4 + sizeof(b->jbase);
+	n = b->jlen - b->savejoff;
+	while(a.cap < n)
+		resize(&a);
+	if(pread(b->jfd, a.data, n, b->savejoff) != (ssize_t)n)
+		b->jerr = 1;
+	else{
+		jdrop(b);
+		jrebase(b, &st);
+		jput(b, a.data, n);
+	}
+	arrfree(&a);
+}
+
+/* free memory for buffer */
+void
+buffree(Buffer *b)
+{
+	size_t i;
+
+	arrfree(&b->changes);
+	arrfree(&b->undobytes);
+	arrfree(&b->redo);
+	arrfree(&b->redobytes);
+	arrfree(&b->add);
+	arrfree(&b->blocks);
+	arrfree(&b->fen);
+	arrfree(&b->jbuf);
+	for(i = 0; i < b->cols.len; i++)
+		arrfree(&((Cols *)b->cols.data)[i].marks);
+	arrfree(&b->cols);
+	pfree(b->root);
+	for(i = 0; i < b->window.len; i++)
+		free(((Chunk *)b->window.data)[i].p);
+	arrfree(&b->window);
+	if(b->ofd != -1)
+		close(b->ofd);
+	if(b->mapped)
+		munmap(b->orig, b->osize);
+	else
+		free(b->orig);
+	free(b->c);
+}
+
+/* buffer i of the buffer table */
+Buffer *
+bufat(size_t i)
+{
+	return ((Buffer **)bufs.data)[i];
+}
+
+/* add buffer for given file to the buffer table, without reading it */
+Buffer *
+bufnew(const char *path)
+{
+	Buffer *b;
+
+	if((b = calloc(1, sizeof(Buffer))) == NULL)
+		return NULL;
+	if((b->path = strdup(path)) == NULL){
+		free(b);
+		return NULL;
+	}
+	b->lead = &b->addr2;
+	b->jfd = -1;
+	APPEND(&bufs, Buffer *, b);
+	return b;
+}
+
+/* read in buffer's file, keeping its place if the file is unchanged */
+int
+bufload(Buffer *b)
+{
+	unsigned long long base[3];
+	size_t k;
+	Array *arr[] = {
+		&b->changes, &b->undobytes, &b->redo,
+		&b->redobytes, &b->add, &b->blocks, &b->fen, &b->jbuf, &b->cols
+	};
+	const size_t size[] = {
+		sizeof(Change), 1, sizeof(Change), 1, 1, sizeof(Block), sizeof(Block), 1,
+		sizeof(Cols)
+	};
+
+	memcpy(base, b->jbase, sizeof(base));
+	b->dirty = b->trimmed = 0;
+	b->counted = 0;
+	b->edits = 0;
+	for(k = 0; k < LEN(arr); k++){
+		if(arrinit(arr[k], size[k]) == -1)
+			break;
+	}
+	if(k == LEN(arr) && fileinit(b) != -1){
+		if(memcmp(base, b->jbase, sizeof(base)) != 0)
+			b->addr1 = b->addr2 = b->vstart = b->vline = 0;
+		if(jinit(b) != -1){
+			b->loaded = 1;
+			return 0;
+		}
+		buffree(b);
+		return -1;
+	}
+	while(k-- > 0)
+		arrfree(arr[k]);
+	return -1;
+}
+
+/* release memory held by buffer, which is reread when next used */
+void
+bufunload(Buffer *b)
+{
+	buffree(b);
+	b->loaded = 0;
+	if(shown == b)
+		shown = NULL;
+}
+
+/* remove buffer i from the buffer table */
+void
+bufdel(size_t i)
+{
+	Buffer *b;
+
+	b = bufat(i);
+	if(b->loaded)
+		bufunload(b);
+	free(b->path);
+	free(b);
+	memmove((Buffer **)bufs.data + i, (Buffer **)bufs.data + i + 1,
+	        sizeof(Buffer *) * (bufs.len - i - 1));
+	bufs.len--;
+}
+
+/* memory held by buffer's contents, history and indexes */
+size_t
+bufmem(Buffer *b)
+{
+	return ((b->kind == Gap) ? b->cap : b->add.cap +
+	        ((b->ofd != -1) ? b->window.len * Chunklen : b->osize)) +
+	       (b->changes.cap + b->redo.cap) * sizeof(Change) +
+	       b->undobytes.cap + b->redobytes.cap +
+	       (b->blocks.cap + b->fen.cap) * sizeof(Block) + b->jbuf.cap;
+}
+
+/* release inactive, clean buffers, least recently used first,
+ * until the buffers read in fit in the memory budget */
 void
-terminit(void)
+budget(void)
 {
-	struct termios new;
+	Buffer *b, *lru;
+	size_t i, n;
 
-	if(tcgetattr(STDIN_FILENO, &new) != -1){
-		term = new;
-		new.c_iflag &= ~(BRKINT | ISTRIP | INLCR | INPCK | IXON);
-		new.c_oflag &= ~OPOST;
-		new.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-		new.c_cflag |= CS8;
-		new.c_cc[VMIN] = 0;
-		new.c_cc[VTIME] = 1; /* ds */
-		if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &new) != -1)
+	for(;;){
+		lru = NULL;
+		for(i = n = 0; i < bufs.len; i++){
+			b = bufat(i);
+			if(!b->loaded)
+				continue;
+			n += bufmem(b);
+			if(b != buf && !b->dirty && b->saver == 0 && b->jfd == -1 &&
+			   (lru == NULL || b->used < lru->used))
+				lru = b;
+		}
+		if(n <= bufmax || lru == NULL)
 			return;
+		bufunload(lru);
 	}
-	perror("terminit");
-	exit(1);
 }
 
-/* allocate memory for dynamic array */
+/* switch to buffer i, reading it in if need be */
 int
-arrinit(Array *a, size_t size)
+use(size_t i)
 {
-	a->data = calloc(Gaplen, size);
-	if(a->data == NULL)
+	Buffer *b;
+
+	b = bufat(i);
+	if(!b->loaded && bufload(b) == -1)
 		return -1;
-	a->size = size;
-	a->len = 0;
-	a->cap = Gaplen;
+	current = i;
+	buf = b;
+	buf->used = ++uses;
+	budget();
 	return 0;
 }
 
-/* free memory for dynamic array */
+/* ask terminal whether it can synchronize output (DEC private mode 2026),
+ * following the query with a device attributes request all terminals answer;
+ * input up to the attributes reply is dropped, and all of it if none comes */
 void
-arrfree(Array *a)
+syncinit(void)
 {
-	free(a->data);
-}
+	static const char q[] = "\x1b[?2026$p\x1b[c";
+	char s[32];
+	size_t n;
+	int c;
 
-/* initialise buffer for given file */
-int
-bufinit(int i, const char *path)
-{
-	bufs[i].addr1 = bufs[i].addr2 = bufs[i].vstart = bufs[i].vline = 0;
-	bufs[i].lead = &bufs[i].addr2;
-	bufs[i].dirty = 0;
-	strncpy(bufs[i].path, path, PATH_MAX);
-	if(arrinit(&bufs[i].changes, sizeof(Change)) != -1){
-		if(fileinit(&bufs[i]) != -1)
-			return 0;
-		arrfree(&bufs[i].changes);
+	if(write(STDOUT_FILENO, q, sizeof(q) - 1) != sizeof(q) - 1)
+		return;
+	while((c = getbyte(Replyms)) != -1){
+		if(c != Kesc || (c = getbyte(Replyms)) != '[')
+			continue;
+		for(n = 0; (c = getbyte(Replyms)) != -1 && (c < 0x40 || c > 0x7e); )
+			if(n < sizeof(s) - 1)
+				s[n++] = c;
+		if(c == -1)
+			break;
+		s[n] = 0;
+		if(c == 'y' && (strcmp(s, "?2026;1$") == 0 || strcmp(s, "?2026;2$") == 0))
+			syncout = 1;
+		else if(c == 'c' && s[0] == '?')
+			return;
 	}
-	return -1;
-}
-
-/* free memory for buffer */
-void
-buffree(Buffer *b)
-{
-	arrfree(&b->changes);
-	free(b->c);
+	ringr = ringw; /* replies cut short: don't leave them to key() */
+	tcflush(keyfd, TCIFLUSH);
 }
 
 /* initialise all components of the editor */
 void
 init(int n, char **paths)
 {
+	char path[PATH_MAX];
+	Buffer *b;
 	int i;
 
 	sigpend();
 	setlocale(LC_ALL, "");
+	if(arrinit(&bufs, sizeof(Buffer *)) == -1)
+		goto Error;
 	for(i = 0; i < n; i++){
-		if((bufinit(i, paths[i + 1])) == -1)
+		if((b = bufnew(paths[i])) == NULL)
 			goto Error;
+		/* read in the first file now, and any with changes to recover;
+		 * the rest are read in when first switched to */
+		if((i == 0 || jexists(b)) && bufload(b) == -1){
+			if(errno != ESTALE && errno != EEXIST)
+				goto Error;
+			jpath(b, path);
+			if(errno == ESTALE)
+				fprintf(stderr, "er: %s has changed since its journal %s was "
+				        "written; use -d to discard it\n", paths[i], path);
+			else
+				fprintf(stderr, "er: %s has a journal %s from an unfinished session; "
+				        "use -r to recover it or -d to discard it\n", paths[i], path);
+			exit(1);
+		}
 	}
 	if(arrinit(&ybuf, 1) == -1)
 		goto Error;
@@ -738,7 +2650,28 @@ init(int n, char **paths)
 		goto Error;
 	if(arrinit(&dbuf, 1) == -1)
 		goto Error;
-	terminit();
+	if(arrinit(&sbuf, 1) == -1)
+		goto Error;
+	if(arrinit(&pbuf, 1) == -1)
+		goto Error;
+	if(arrinit(&rbuf, 1) == -1)
+		goto Error;
+	if(arrinit(&hits, sizeof(Hit)) == -1)
+		goto Error;
+	if(arrinit(&frame, sizeof(Cell)) == -1)
+		goto Error;
+	if(arrinit(&shadow, sizeof(Cell)) == -1)
+		goto Error;
+	if(arrinit(&vbuf, 1) == -1)
+		goto Error;
+	if(arrinit(&kbuf, 1) == -1)
+		goto Error;
+	if(arrinit(&pfds, sizeof(struct pollfd)) == -1)
+		goto Error;
+	if(!headless){
+		terminit();
+		syncinit();
+	}
 	siginit();
 	return;
 Error:
@@ -750,247 +2683,759 @@ Error:
 void
 termreset(void)
 {
+	(void)!write(STDOUT_FILENO, CSI("?2004l"), 8);
 	(void)!write(STDOUT_FILENO, CSI("9999;1H\r\n"), 11);
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &term);
 }
 
+/* collect progress of buffer's background save, waiting for it to finish if
+ * block is set; returns 1 while it runs, 0 once written and -1 if it failed */
+int
+savepoll(Buffer *b, int block)
+{
+	struct pollfd p = { b->savefd, POLLIN, 0 };
+	size_t n[64];
+	ssize_t r;
+	int s;
+
+	for(;;){
+		if(block)
+			poll(&p, 1, -1);
+		if((r = read(b->savefd, n, sizeof(n))) > 0)
+			b->saved = n[r / sizeof(n[0]) - 1];
+		else if(r == -1 && errno == EAGAIN && !block)
+			return 1;
+		else if(r == 0 || (errno != EINTR && errno != EAGAIN))
+			break;
+	}
+	close(b->savefd);
+	while(waitpid(b->saver, &s, 0) == -1 && errno == EINTR)
+		;
+	b->saver = 0;
+	if(!WIFEXITED(s) || WEXITSTATUS(s) != 0)
+		return -1;
+	if(b->edits == b->saveedits)
+		b->dirty = 0;
+	jrestart(b);
+	return 0;
+}
+
 /* deinitialise all components of the editor */
 void
 end(void)
 {
 	size_t i;
 
-	termreset();
-	for(i = 0; i < nbuf; i++)
-		buffree(&buf[i]);
+	if(!headless)
+		termreset();
+	for(i = 0; i < bufs.len; i++){
+		while(bufat(i)->saver != 0)
+			savepoll(bufat(i), 1);
+		if(status != Panic)
+			jdrop(bufat(i));
+	}
+	while(bufs.len > 0)
+		bufdel(bufs.len - 1);
+	arrfree(&bufs);
 	arrfree(&ybuf);
 	arrfree(&bbuf);
 	arrfree(&dbuf);
+	arrfree(&sbuf);
+	arrfree(&pbuf);
+	arrfree(&rbuf);
+	arrfree(&hits);
+	arrfree(&frame);
+	arrfree(&shadow);
+	arrfree(&vbuf);
+	arrfree(&kbuf);
+	arrfree(&pfds);
+	if(pat == Pregex)
+		regfree(&preg);
+#ifdef STATS
+	statdump("er.stats");
+#endif
 }
 
-/* revert last sequence of changes, popping from top of undo stack */
+/* revert last sequence of changes, moving it from undo to redo stack */
 void
 undo(size_t *a, size_t *b)
 {
-	Change m;
+	Change m, x;
 
 	if(buf->changes.len > 0){
 		buf->changes.len--;
+		x.type = Uend;
+		APPEND(&buf->redo, Change, x);
 		while(buf->changes.len > 0){
 			m = ((Change *)buf->changes.data)[--buf->changes.len];
+			x = m;
 			switch(m.type){
 			case Uinsert:
-				delete(m.i, 0);
+				while(buf->redobytes.cap < buf->redobytes.len + m.n)
+					resize(&buf->redobytes);
+				x.off = buf->redobytes.len;
+				bytes((char *)buf->redobytes.data + x.off, m.i, m.n);
+				buf->redobytes.len += m.n;
+				delete(m.i, m.n, 0);
 				*a = *b = m.i;
 				break;
 			case Udelete:
-				insert(m.i, m.c, 0);
+				insert(m.i, (char *)buf->undobytes.data + m.off, m.n, 0);
+				buf->undobytes.len = m.off;
 				*a = *b = m.i;
 				break;
 			case Uend:
 				buf->changes.len++;
 				return;
 			}
+			APPEND(&buf->redo, Change, x);
 		}
-	} else /* no more changes */
+	} else if(!buf->trimmed) /* no more changes */
 		buf->dirty = 0;
 }
 
-/* write contents of byte string to file */
+/* reapply last sequence of undone changes, moving it back to undo stack */
+void
+redo(size_t *a, size_t *b)
+{
+	Change m;
+
+	redoing = 1;
+	while(buf->redo.len > 0){
+		m = ((Change *)buf->redo.data)[--buf->redo.len];
+		switch(m.type){
+		case Uinsert:
+			insert(m.i, (char *)buf->redobytes.data + m.off, m.n, 1);
+			buf->redobytes.len = m.off;
+			*a = *b = m.i + m.n;
+			break;
+		case Udelete:
+			delete(m.i, m.n, 1);
+			*a = *b = m.i;
+			break;
+		case Uend:
+			record(Uend, 0, 0);
+			redoing = 0;
+			return;
+		}
+	}
+	redoing = 0;
+}
+
+/* write entire contents of current buffer to file */
 ssize_t
-writeall(int f, const char *s, size_t n)
+writef(int f)
 {
-	int w;
-	ssize_t r;
+	const char *s;
+	size_t i, n;
 
-	r = n;
-	while(n){
-		w = write(f, s, n);
-		if(w == -1){
-			if(errno == EINTR)
-				w = 0;
-			else
+	for(i = 0; (n = span(i, &s)) > 0; i += n){
+		if(writeall(f, s, n) == -1)
+			return -1;
+	}
+	return i;
+}
+
+/* write up to Scanlen bytes of current buffer from offset to file, copying
+ * pieces of the original file across without reading them into the window
+ * in large-file mode; returns the number written */
+ssize_t
+writespan(int f, size_t i)
+{
+	const char *p;
+	size_t n, off;
+	ssize_t k;
+	Piece *q;
+
+	if(buf->kind == Pieces && buf->ofd != -1 && (q = pfind(i, &off))->src == Orig){
+		n = (q->n - off < Scanlen) ? q->n - off : Scanlen;
+		while(sbuf.cap < n)
+			resize(&sbuf);
+		for(i = 0; i < n; i += k){
+			k = pread(buf->ofd, (char *)sbuf.data + i, n - i, q->off + off + i);
+			if(k == 0 || (k == -1 && errno != EINTR))
 				return -1;
+			if(k == -1)
+				k = 0;
 		}
-		s += w;
-		n -= w;
+		p = sbuf.data;
+	}else if((n = span(i, &p)) > Scanlen)
+		n = Scanlen;
+	return writeall(f, p, n);
+}
+
+/* write current buffer to a temporary file and rename it over its own
+ * (or, where that cannot be done or would lose links or ownership, write
+ * it in place), reporting bytes written so far on f (unless -1) */
+ssize_t
+replacef(int f)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 8], *s;
+	struct stat st;
+	size_t i, n;
+	ssize_t r;
+	int fd, inplace, old;
+
+	if(realpath(buf->path, path) == NULL) /* follow links to the real file */
+		snprintf(path, sizeof(path), "%s", buf->path);
+	/* a new file would lose other links and ownership */
+	old = stat(path, &st) != -1;
+	inplace = old && (st.st_nlink > 1 || st.st_uid != geteuid() || st.st_gid != getegid());
+	fd = -1;
+	if(!inplace){
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+		if((fd = mkstemp(tmp)) == -1) /* e.g. directory is read-only */
+			inplace = 1;
+		else if(old)
+			fchmod(fd, st.st_mode & 07777);
+	}
+	if(inplace){
+		if(buf->mapped || buf->ofd != -1){ /* still being read from */
+			errno = EBUSY;
+			return -1;
+		}
+		if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+			return -1;
+	}
+	for(i = 0, r = 0; i < len() && r != -1; i += r){
+		if((r = writespan(fd, i)) != -1 && f != -1){
+			n = i + r;
+			(void)!write(f, &n, sizeof(n));
+		}
+	}
+	if(r != -1 && fsyncs > 0 && fsync(fd) == -1)
+		r = -1;
+	if(close(fd) == -1 || r == -1 || (!inplace && rename(tmp, path) == -1)){
+		if(!inplace)
+			unlink(tmp);
+		return -1;
+	}
+	if(fsyncs > 1 && !inplace){ /* make the rename itself durable */
+		if((s = strrchr(path, '/')) == NULL)
+			strcpy(path, ".");
+		else if(s == path)
+			s[1] = 0;
+		else
+			*s = 0;
+		if((fd = open(path, O_RDONLY)) != -1){
+			fsync(fd);
+			close(fd);
+		}
+	}
+	return i;
+}
+
+/* start writing a snapshot of current buffer in a child process */
+int
+savebg(void)
+{
+	int p[2];
+	pid_t pid;
+
+	if(pipe(p) == -1)
+		return -1;
+	if((pid = fork()) == -1){
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if(pid == 0){
+		signal(SIGINT, SIG_DFL);
+		signal(SIGWINCH, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		close(p[0]);
+		if(sigsetjmp(env, 1) != 0) /* errors end the child alone */
+			_exit(1);
+		_exit(replacef(p[1]) == -1);
+	}
+	close(p[1]);
+	fcntl(p[0], F_SETFL, O_NONBLOCK);
+	buf->saver = pid;
+	buf->savefd = p[0];
+	buf->savelen = len();
+	buf->saved = 0;
+	buf->saveedits = buf->edits;
+	buf->savet = now();
+	jflush(buf);
+	buf->savejoff = buf->jlen;
+	return 0;
+}
+
+/* emergency backup in case of panic */
+void
+save(void)
+{
+	int fd;
+	size_t i;
+
+	fd = -1;
+	for(i = 0; i < bufs.len; i++){
+		if(!bufat(i)->loaded)
+			continue;
+		if(jflush(bufat(i)) != -1){
+			jsync(bufat(i), 1);
+			continue; /* recoverable from its journal */
+		}
+		if(fd == -1 && (fd = creat("er.out", 0666)) == -1)
+			return;
+		buf = bufat(i);
+		writef(fd);
+	}
+	if(fd != -1)
+		close(fd);
+}
+
+/* flush contents of screen buffer to STDOUT in one write */
+void
+vflush(void)
+{
+	if(vbuf.len > 0 && writeall(STDOUT_FILENO, vbuf.data, vbuf.len) == -1)
+		err(Panic);
+	TALLYOUT(vbuf.len);
+	vbuf.len = 0;
+}
+
+/* append bytes to screen buffer */
+void
+vput(const char *s, size_t n)
+{
+	while(vbuf.cap < vbuf.len + n)
+		resize(&vbuf);
+	memcpy((char *)vbuf.data + vbuf.len, s, n);
+	vbuf.len += n;
+}
+
+/* append string to screen buffer */
+void
+vstr(const char *s)
+{
+	vput(s, strlen(s));
+}
+
+/* append decimal number to screen buffer */
+void
+vnum(unsigned int v)
+{
+	char tmp[16], *s;
+
+	s = tmp + sizeof(tmp);
+	do
+		*--s = '0' + v % 10;
+	while((v /= 10) > 0);
+	vput(s, tmp + sizeof(tmp) - s);
+}
+
+/* position cursor */
+void
+cursor(unsigned int x, unsigned int y)
+{
+	vstr(CSI(""));
+	vnum(y + 1);
+	vput(";", 1);
+	vnum(x + 1);
+	vput("H", 1);
+}
+
+/* draw message to status bar */
+void
+bar(const char *fmt, ...){
+	int n;
+	va_list args;
+
+	while(bbuf.cap < (size_t)dim.ws_col + 1)
+		resize(&bbuf);
+	va_start(args, fmt);
+	n = vsnprintf(bbuf.data, dim.ws_col + 1, fmt, args);
+	va_end(args);
+	cursor(0, dim.ws_row - 1);
+	vstr(CSI("0;36m"));
+	vstr(bbuf.data);
+	if(n > dim.ws_col){
+		cursor(dim.ws_col - 2, dim.ws_row - 1);
+		vstr(CSI("35m>"));
+		vstr(CSI("0m"));
+	}
+	vstr(CSI("K"));
+	vstr(CSI("0m"));
+	vflush();
+}
+
+/* start dialogue prompt in status bar, calling f (if any) as it changes */
+int
+dialogue(const char *prompt, void (*f)(void))
+{
+	char *s;
+	int k;
+
+	bar("%s%s", prompt, dbuf.data);
+	while((k = key()) != '\n'){
+		if(k == -1)
+			continue;
+		else if(k == Kesc){
+			bar("");
+			return -1;
+		}else if(k == Kbs && dbuf.len > 0)
+			while(dbuf.len)
+				((char *)dbuf.data)[--dbuf.len] = 0;
+			/* TODO: single character backspace (handling multibyte properly) */
+		else{
+			s = ch;
+			while (*s)
+				APPEND(&dbuf, char, *s++);
+		}
+		if(f != NULL)
+			f();
+		bar("%s%s", prompt, dbuf.data);
+	}
+	return 0;
+}
+
+/* find regular expression in current buffer from offset, one line at a time,
+ * in lines starting before limit; long lines are cut Hitrun bytes past it,
+ * so matches starting before it are found if they are no longer than that */
+int
+regsearch(regex_t *reg, size_t i, size_t lim, size_t *so, size_t *eo)
+{
+	regmatch_t m[1];
+	size_t j, e;
+	int r, f;
+
+	r = REG_NOMATCH;
+	e = (lim + Hitrun < len()) ? lim + Hitrun : len();
+	while(i < lim){
+		j = findnlto(i, e);
+		while(sbuf.cap < j - i + 1)
+			resize(&sbuf);
+		bytes(sbuf.data, i, j - i);
+		((char *)sbuf.data)[j - i] = 0;
+		f = (i > 0 && at(i - 1) != '\n') ? REG_NOTBOL : 0;
+		if(j < len() && at(j) != '\n') /* cut short */
+			f |= REG_NOTEOL;
+		r = regexec(reg, sbuf.data, 1, m, f);
+		if(r == 0){
+			*so = i + m[0].rm_so;
+			*eo = i + m[0].rm_eo;
+			break;
+		}else if(r != REG_NOMATCH)
+			break;
+		i = j + 1;
+	}
+	return r;
+}
+
+/* first occurrence of string s (n > 0 bytes) lying wholly within p (k bytes) */
+const char *
+memfind(const char *p, size_t k, const char *s, size_t n)
+{
+	const char *q, *e;
+#ifdef Vlen
+	Vec f, l;
+	unsigned m;
+#endif
+
+	if(n > k)
+		return NULL;
+	q = p;
+	e = p + k - n; /* last possible start */
+#ifdef Vlen
+	/* candidates match both first and last byte of s */
+	f = vset(s[0]);
+	l = vset(s[n - 1]);
+	for(; e - q >= Vlen; q += Vlen){
+		m = veq(vload(q), f) & veq(vload(q + n - 1), l);
+		for(; m != 0; m &= m - 1){
+			if(memcmp(q + ffs(m) - 1, s, n) == 0)
+				return q + ffs(m) - 1;
+		}
+	}
+#endif
+	while(q <= e && (q = memchr(q, s[0], e - q + 1)) != NULL){
+		if(memcmp(q, s, n) == 0)
+			return q;
+		q++;
+	}
+	return NULL;
+}
+
+/* whether string s (n bytes) occurs in current buffer at offset i */
+int
+matchat(size_t i, const char *s, size_t n)
+{
+	const char *p;
+	size_t k;
+
+	while(n > 0 && (k = span(i, &p)) > 0){
+		if(k > n)
+			k = n;
+		if(memcmp(p, s, k) != 0)
+			return 0;
+		s += k;
+		i += k;
+		n -= k;
+	}
+	return n == 0;
+}
+
+/* find literal pattern in current buffer from offset, scanning spans in place,
+ * for matches starting before limit */
+int
+litsearch(size_t i, size_t lim, size_t *so, size_t *eo)
+{
+	const char *p, *q, *s;
+	size_t j, k, m, n;
+
+	s = pbuf.data;
+	n = pbuf.len;
+	while(i < lim && (k = span(i, &p)) > 0){
+		m = (k < lim - i) ? k : lim - i; /* starts to consider */
+		if((q = memfind(p, (k < m + n - 1) ? k : m + n - 1, s, n)) != NULL){
+			*so = i + (q - p);
+			*eo = *so + n;
+			return 0;
+		}
+		for(j = (k < n) ? 0 : k - n + 1; j < m; j++){ /* straddling spans */
+			if(p[j] == s[0] && matchat(i + j, s, n)){
+				*so = i + j;
+				*eo = *so + n;
+				return 0;
+			}
+		}
+		i += k;
+	}
+	return REG_NOMATCH;
+}
+
+/* set search pattern from string, returning any regcomp error */
+int
+setpat(const char *s)
+{
+	int r;
+
+	if(pat == Pregex)
+		regfree(&preg);
+	pat = Pnone;
+	if(*s == 0)
+		return 0;
+	if(strpbrk(s, ".[]()*+?{}|^$\\") == NULL){ /* skip the regex engine */
+		pbuf.len = strlen(s);
+		while(pbuf.cap < pbuf.len)
+			resize(&pbuf);
+		memcpy(pbuf.data, s, pbuf.len);
+		pat = Plit;
+		return 0;
 	}
+	if((r = regcomp(&preg, s, REG_EXTENDED | REG_NEWLINE)) == 0)
+		pat = Pregex;
 	return r;
 }
 
-/* write entire contents of current buffer to file */
-ssize_t
-writef(int f)
+/* find search pattern in current buffer from offset, starting before limit */
+int
+find(size_t i, size_t lim, size_t *so, size_t *eo)
 {
-	ssize_t n, r;
-
-	n = writeall(f, buf->c, buf->start);
-	if(n == -1)
-		return -1;
-	r = writeall(f, buf->c + buf->start + buf->gap, len() - buf->start);
-	if(r == -1)
-		return -1;
-	return r + n;
+	switch(pat){
+	case Plit:
+		return litsearch(i, lim, so, eo);
+	case Pregex:
+		return regsearch(&preg, i, lim, so, eo);
+	}
+	return REG_NOMATCH;
 }
 
-/* emergency backup in case of panic */
-void
-save(void)
+/* find search pattern in whole of current buffer from offset,
+ * giving up (returning -1) if escape is pressed */
+int
+scan(size_t i, size_t *so, size_t *eo)
 {
-	int fd;
-	size_t i;
+	size_t j, lim;
+	int r;
 
-	fd = creat("er.out", 0666);
-	if(fd > 0){
-		for(i = 0; i < nbuf; i++){
-			buf = &bufs[i];
-			writef(fd);
-		}
-		close(fd);
+	for(j = i;; i = lim){
+		lim = (len() - i > Scanlen) ? i + Scanlen : len();
+		if((r = find(i, lim, so, eo)) != REG_NOMATCH || lim == len())
+			return r;
+		if(i == j)
+			bar("Searching... (ESC to cancel)");
+		if(escaped())
+			return -1;
 	}
 }
 
-/* flush contents of screen buffer to STDOUT */
-void
-vflush(void)
+/* offset a screenful of lines past offset, bounding on-screen searches */
+size_t
+screenful(size_t i)
 {
-	if(writeall(STDOUT_FILENO, vbuf, vbuflen) == -1)
-		err(Panic);
-	vbuflen = 0;
+	size_t j;
+
+	j = linestart(lineof(i) + dim.ws_row);
+	return (j - i > Hitmax) ? i + Hitmax : j;
 }
 
-/* append to screen buffer */
+/* collect matches of search pattern in displayed part of current buffer,
+ * scrolled h columns sideways with w columns of text showing */
 void
-vpush(int n, ...)
+hilite(int h, int w)
 {
-	int i;
-	char *s;
-	va_list args;
+	Hit hit;
+	Mark p;
+	size_t i, s, lim;
+	int r;
 
-	va_start(args, n);
-	for(i = 0; i < n; i++){
-		s = va_arg(args, char*);
-		while(*s){
-			if(vbuflen == Vbufmax)
-				vflush();
-			vbuf[vbuflen++] = *s++;
+	hits.len = 0;
+	if(pat == Pnone)
+		return;
+	for(r = 0, s = buf->vstart; r < dim.ws_row - 1 && s < len(); s = linestart(buf->vline + ++r)){
+		p.off = p.n = (size_t)-1;
+		p.col = h + w;
+		colwalk(s, &p);
+		lim = (p.off < len()) ? p.off + 1 : len();
+		i = s;
+		if(h > 0){ /* from a little left of the screen */
+			p.off = p.n = (size_t)-1;
+			p.col = h;
+			colwalk(s, &p);
+			i = (p.off - s > Hitrun) ? p.off - Hitrun : s;
+		}
+		while(find(i, lim, &hit.so, &hit.eo) == 0 && hit.so < lim){
+			if(hit.eo > hit.so)
+				APPEND(&hits, Hit, hit);
+			i = (hit.eo > hit.so) ? hit.eo : hit.so + 1;
 		}
 	}
-	va_end(args);
 }
 
-/* position cursor */
+/* draw glyph of given width into next frame, clipped to the screen
+ * (a zero width glyph combines with the one before) */
 void
-cursor(unsigned int x, unsigned int y)
+put(int x, int y, const char *s, int w, short attr)
 {
-	char tmp[32];
-	if(snprintf(tmp, sizeof(tmp), CSI("%u;%uH"), y + 1 , x + 1) < 0)
-		err(Panic);
-	vpush(1, tmp);
+	Cell *c;
+	size_t n;
+
+	if(w == 0){
+		if(x < 1 || x > dim.ws_col)
+			return;
+		c = (Cell *)frame.data + y * dim.ws_col + x - 1;
+		n = strlen(c->c);
+		if(n > 0 && n + strlen(s) < sizeof(c->c))
+			strcpy(c->c + n, s);
+		return;
+	}
+	if(x < 0 || x + w > dim.ws_col)
+		return;
+	c = (Cell *)frame.data + y * dim.ws_col + x;
+	for(n = 0; n < sizeof(c->c) - 1 && s[n]; n++)
+		c->c[n] = s[n];
+	c->c[n] = 0;
+	c->attr = attr;
+	while(--w > 0){
+		(++c)->c[0] = 0;
+		c->attr = attr;
+	}
 }
 
-/* draw message to status bar */
+/* draw ASCII string into next frame */
 void
-bar(const char *fmt, ...){
-	int n;
-	va_list args;
+text(int x, int y, const char *s, short attr)
+{
+	char t[2] = { 0, 0 };
 
-	while(bbuf.cap < (size_t)dim.ws_col + 1)
-		resize(&bbuf);
-	va_start(args, fmt);
-	n = vsnprintf(bbuf.data, dim.ws_col + 1, fmt, args);
-	va_end(args);
-	cursor(0, dim.ws_row - 1);
-	vpush(3, CSI("0m"), CSI("36m"), bbuf.data);
-	if(n > dim.ws_col){
-		cursor(dim.ws_col - 2, dim.ws_row - 1);
-		vpush(2, CSI("35m>"), CSI("0m"));
+	for(; *s; s++, x++){
+		t[0] = *s;
+		put(x, y, t, 1, attr);
 	}
-	vpush(2, CSI("K"), CSI("0m"));
-	vflush();
 }
 
-/* start dialogue prompt in status bar */
-int
-dialogue(const char *prompt)
+/* set terminal graphic rendition for cell attributes */
+void
+sgr(short attr)
 {
-	char *s;
-	int k;
-
-	bar("%s%s", prompt, dbuf.data);
-	while((k = key()) != '\n'){
-		if(k == -1)
-			continue;
-		else if(k == Kesc){
-			bar("");
-			return -1;
-		}else if(k == Kbs && dbuf.len > 0)
-			while(dbuf.len)
-				((char *)dbuf.data)[--dbuf.len] = 0;
-			/* TODO: single character backspace (handling multibyte properly) */
-		else{
-			s = ch;
-			while (*s)
-				APPEND(&dbuf, char, *s++);
-		}
-		bar("%s%s", prompt, dbuf.data);
+	vstr(CSI("0"));
+	if(attr & Arev)
+		vput(";7", 2);
+	if(attr & Aunder)
+		vput(";4", 2);
+	if(attr & 0xFF){
+		vput(";", 1);
+		vnum(attr & 0xFF);
 	}
-	return 0;
+	vput("m", 1);
 }
 
-/* search for regular expression in current buffer */
+/* scroll text rows of terminal and shadow screen up by n lines (down if negative) */
 void
-search(size_t *a, size_t *b, int replace, int all)
+scroll(int n)
 {
-	regex_t reg;
-	regmatch_t m[1];
-	char err[128], *s;
-	int r;
-	size_t n, k;
+	Cell *s, blank = { " ", 0 };
+	int i, d, k, m;
 
-	if(dialogue(replace ?
-	            (all? "Replace all: " : "Replace: ") : "Search: ") == -1)
-		return;
-	r = regcomp(&reg, dbuf.data, REG_EXTENDED | REG_NEWLINE);
-	k = 0;
-	if(r == 0){
-		if(replace && dialogue("with: ") == -1){
-			regfree(&reg);
-			return;
-		}
-		do{
-			move(len()); /* please mind the gap */
-			r = regexec(&reg, buf->c + *b, 1, m, 0);
-			if(r == 0 && *b + m[0].rm_so < len()){
-				*a = *b + m[0].rm_so;
-				*b += m[0].rm_eo - 1;
-				if(replace){
-					n = 1 + *b - *a;
-					while(n-- > 0)
-						delete(*a, 1);
-					*b = *a;
-					s = dbuf.data;
-					while(*s)
-						insert((*b)++, *s++, 1);
-					*a = *b;
-					k++;
-					record(Uend, 0, 0);
-				}
-			}else
+	d = (n < 0) ? -n : n;
+	vstr(CSI("0m"));
+	vstr(CSI("1;")); /* region of text rows */
+	vnum(dim.ws_row - 1);
+	vstr("r");
+	vstr(CSI(""));
+	vnum(d);
+	vstr((n < 0) ? "T" : "S");
+	vstr(CSI("r"));
+	s = shadow.data;
+	k = d * dim.ws_col;
+	m = (dim.ws_row - 1 - d) * dim.ws_col;
+	if(n > 0){
+		memmove(s, s + k, sizeof(Cell) * m);
+		s += m;
+	}else
+		memmove(s + k, s, sizeof(Cell) * m);
+	for(i = 0; i < k; i++) /* exposed lines are blank */
+		s[i] = blank;
+}
+
+/* write cells of next frame that differ from shadow screen, then cursor */
+void
+paint(int x2, int y2)
+{
+	Cell *f, *s;
+	int x, y, e, w, cx, cy;
+	short attr;
+
+	cx = cy = attr = -1; /* unknown */
+	for(y = 0; y < dim.ws_row - 1; y++){
+		f = (Cell *)frame.data + y * dim.ws_col;
+		s = (Cell *)shadow.data + y * dim.ws_col;
+		for(e = dim.ws_col; e > 0 && f[e - 1].attr == 0 && strcmp(f[e - 1].c, " ") == 0; e--)
+			;
+		for(x = 0; x < dim.ws_col; x += w){
+			w = 1;
+			if(f[x].attr == s[x].attr && strcmp(f[x].c, s[x].c) == 0)
+				continue;
+			if(f[x].c[0] == 0) /* right half of wide glyph */
+				while(x > 0 && f[--x].c[0] == 0)
+					;
+			if(x != cx || y != cy)
+				cursor(x, y);
+			if(x >= e){ /* rest of row is blank */
+				if(attr != 0)
+					sgr(attr = 0);
+				vstr(CSI("K"));
 				break;
-		}while(all && r == 0);
-	}
-	bar("");
-	if(r != 0){
-		if(k > 0)
-			bar("Replaced %ld matches", k);
-		else{
-			regerror(r, &reg, err, sizeof(err));
-			bar(err);
+			}
+			if(f[x].attr != attr)
+				sgr(attr = f[x].attr);
+			vstr(f[x].c);
+			while(x + w < dim.ws_col && f[x + w].c[0] == 0)
+				w++;
+			cx = x + w;
+			cy = y;
 		}
 	}
-	regfree(&reg);
-	return;
+	memcpy(shadow.data, frame.data, sizeof(Cell) * (dim.ws_row - 1) * dim.ws_col);
+	if(attr != 0)
+		vstr(CSI("0m"));
+	cursor(x2, y2);
+	if(syncout)
+		vstr(CSI("?2026l"));
+	vflush();
 }
 
 /* display current buffer to terminal */
@@ -998,63 +3443,99 @@ void
 display(void)
 {
 	int i, j, l, i2, j2, n, h, jp, width;
-	size_t k, kp;
+	long d;
+	size_t k, m, cells;
 	char tmp[32];
+	short attr;
+	Cell *c, blank = { " ", 0 };
+	Hit *hit;
+	Mark p;
 
-	vflush();
+	if(syncout) /* terminal holds frame until it is complete */
+		vstr(CSI("?2026h"));
+	cells = (dim.ws_row - 1) * dim.ws_col;
+	if(repaint){ /* forget what is on screen */
+		while(frame.cap < cells)
+			resize(&frame);
+		while(shadow.cap < cells)
+			resize(&shadow);
+		for(c = shadow.data; c < (Cell *)shadow.data + cells; c++)
+			c->attr = -1;
+		vstr(CSI("?25h"));
+		repaint = 0;
+		shown = NULL;
+	}
+	view(lineof(buf->vstart)); /* edits may have shifted lines above */
+	d = buf->vline - shownline;
+	if(shown == buf && d != 0 && labs(d) < dim.ws_row - 1)
+		scroll(d);
+	shown = buf;
+	shownline = buf->vline;
 	l = digits(buf->vline + dim.ws_row);
 	j2 = l + 2;
 	h = 0;
-Restart:
-	for(i = jp = j = i2 = 0, kp = k = buf->vstart; i < dim.ws_row - 1; i++, jp = j = 0){
-		cursor(j, i);
+	if(lineof(*buf->lead) - buf->vline < (size_t)dim.ws_row - 1){
+		/* scroll sideways far enough to show the lead character */
+		p = place(*buf->lead);
+		k = *buf->lead;
+		width = next(&k);
+		d = (long)(l + 2 + p.col + ((width > 0) ? width : 0)) - (dim.ws_col - 1);
+		h = (d > 0) ? d : 0;
+	}
+	hilite(h, dim.ws_col - l - 2);
+	hit = hits.data;
+	for(c = frame.data; c < (Cell *)frame.data + cells; c++)
+		*c = blank;
+	for(i = jp = j = i2 = 0, m = 0, k = buf->vstart; i < dim.ws_row - 1; i++, jp = j = 0){
 		if(k < len()){
-			snprintf(tmp, sizeof(tmp), CSI("34m %*ld "), l, buf->vline + i);
-			vpush(2, tmp, CSI("0m"));
-			if(h > 0){
-				cursor(0, i);
-				vpush(2, CSI("35m<"), CSI("0m"));
-				cursor(l + 2, i);
-			}
+			snprintf(tmp, sizeof(tmp), " %*ld ", l, buf->vline + i);
+			text(0, i, tmp, 34);
+			if(h > 0)
+				put(0, i, "<", 1, 35);
 			j = l + 2;
-			if(buf->addr1 != buf->addr2 && k >= buf->addr1 && k <= buf->addr2)
-				vpush(1, CSI("7m"));
+			if(h > 0){ /* skip characters left of the screen */
+				p.off = p.n = (size_t)-1;
+				p.col = h;
+				colwalk(k, &p);
+				k = p.off;
+				jp = p.col;
+			}
 			do{
-				if(buf->addr1 != buf->addr2 && k == buf->addr1)
-					vpush(1, CSI("7m"));
-				if(kp == buf->addr2)
-					vpush(1, CSI("0m"));
 				if(k == *buf->lead){
 					j2 = j;
 					i2 = i;
 				}
-				kp = k;
+				attr = 0;
+				if(buf->addr1 != buf->addr2 && k >= buf->addr1 && k <= buf->addr2)
+					attr |= Arev;
+				while(m < hits.len && hit[m].eo <= k)
+					m++;
+				if(m < hits.len && hit[m].so <= k) /* underline matches */
+					attr |= Aunder;
 				width = next(&k);
-				jp += width;
+				jp += (width > 0) ? width : 0;
 				if(jp - width >= h){
 					j = l + 2 + jp - h;
 					if(j <= dim.ws_col){
-						if(ch[0] == '\t') {
+						if(ch[0] == '\t'){
 							for(n = 0; n < width; n++)
-								vpush(1, " ");
-						}else
-							vpush(1, (ch[0] == '\n') ? " " : ch);
+								put(j - width + n, i, " ", 1, attr);
+						}else if(width >= 0)
+							put(j - width, i, (ch[0] == '\n') ? " " : ch, width, attr);
 					}
 				}else{
 					for(n = 0; n < jp - h; n++)
-						vpush(1, " ");
+						put(l + 2 + n, i, " ", 1, attr);
 				}
-				if(kp == *buf->lead && j > (dim.ws_col - 1)){
-					h = j - (dim.ws_col - 1);
-					vbuflen = 0;
-					goto Restart;
+				if(ch[0] != '\n' && l + 2 + jp - h > dim.ws_col){
+					/* rest of line is right of the screen */
+					k = linestart(buf->vline + i + 1);
+					ch[0] = (at(k - 1) == '\n') ? '\n' : 0;
+					j = dim.ws_col;
 				}
 				if(ch[0] == '\n'){
-					if(j > dim.ws_col - 1){
-						cursor(0, i);
-						vpush(2, CSI("35m>"), CSI("0m"));
-						cursor(j, i);
-					}
+					if(j > dim.ws_col - 1)
+						put(0, i, ">", 1, 35);
 					break;
 				}
 			}while(k < len());
@@ -1068,33 +3549,134 @@ Restart:
 				}
 			}
 		}else if(ch[0] == '\n'){
-			snprintf(tmp, sizeof(tmp), CSI("36m %*ld "), l, buf->vline + i);
-			vpush(2, tmp, CSI("0m"));
+			snprintf(tmp, sizeof(tmp), " %*ld ", l, buf->vline + i);
+			text(0, i, tmp, 36);
 			memset(ch, 0, sizeof(ch));
 		}else
-			vpush(2, CSI("90m~"), CSI("0m"));
-		vpush(1, CSI("K"));
+			put(0, i, "~", 1, 90);
+	}
+	paint(j2, i2);
+	TALLYFRAME();
+}
+
+/* select first match of pattern being typed within a screenful of search origin */
+void
+incsearch(void)
+{
+	size_t so, eo;
+
+	buf->addr1 = buf->addr2 = origin;
+	if(setpat(dbuf.data) == 0 &&
+	   find(origin, screenful(origin), &so, &eo) == 0 && so < len() && eo > so){
+		buf->addr1 = so;
+		buf->addr2 = eo - 1;
+	}
+	checkline(1);
+	display();
+}
+
+/* replace every match from offset with dialogue text in one change,
+ * building the new text for the affected span in a single pass */
+size_t
+replaceall(size_t *a, size_t *b)
+{
+	size_t i, k, so, eo, first, last, n;
+
+	rbuf.len = 0;
+	first = last = n = 0;
+	i = *b;
+	while(i < len()){
+		if(find(i, len(), &so, &eo) != 0 || so >= len())
+			break;
+		if(n++ == 0)
+			first = last = so;
+		k = so - last;
+		while(rbuf.cap < rbuf.len + k + dbuf.len)
+			resize(&rbuf);
+		bytes((char *)rbuf.data + rbuf.len, last, k);
+		memcpy((char *)rbuf.data + rbuf.len + k, dbuf.data, dbuf.len);
+		rbuf.len += k + dbuf.len;
+		last = i = eo;
+		if(eo == so) /* step over empty match */
+			next(&i);
+	}
+	if(n > 0){
+		delete(first, last - first, 1);
+		insert(first, rbuf.data, rbuf.len, 1);
+		record(Uend, 0, 0);
+		*a = *b = first + rbuf.len;
+	}
+	return n;
+}
+
+/* search for regular expression in current buffer */
+void
+search(size_t *a, size_t *b, int replace, int all)
+{
+	char err[128];
+	int r;
+	size_t i, j, k, a0, b0;
+	double t;
+
+	a0 = *a;
+	b0 = origin = *b;
+	r = dialogue(replace ? (all? "Replace all: " : "Replace: ") : "Search: ",
+	             replace ? NULL : incsearch);
+	*a = a0;
+	*b = b0;
+	if(r == -1){
+		setpat("");
+		return;
+	}
+	if((r = setpat(dbuf.data)) == 0){
+		if(replace && dialogue("with: ", NULL) == -1)
+			return;
+		if(all){
+			t = now();
+			if((k = replaceall(a, b)) > 0){
+				bar("Replaced %zu matches in %.3fs", k, now() - t);
+				return;
+			}
+			r = REG_NOMATCH;
+		}else{
+			for(k = *b; (r = scan(k, &i, &j)) == 0 && j == i && i < len(); k = i)
+				next(&i); /* step over empty match */
+			if(r == 0 && j == i)
+				r = REG_NOMATCH;
+			if(r == 0 && i < len()){
+				*a = i;
+				*b = j - 1;
+				if(replace){
+					delete(*a, 1 + *b - *a, 1);
+					insert(*a, dbuf.data, dbuf.len, 1);
+					*a = *b = *a + dbuf.len;
+					record(Uend, 0, 0);
+				}
+			}
+		}
+	}
+	bar("");
+	if(r == -1)
+		bar("Search cancelled");
+	else if(r != 0){
+		regerror(r, &preg, err, sizeof(err));
+		bar(err);
 	}
-	vpush(1, CSI("?25h"));
-	cursor(j2, i2);
-	vflush();
 }
 
 /* copy selection in current buffer to yank buffer */
 void
 yank(void)
 {
-	size_t j, k, n;
+	size_t k, n;
 
-	j = buf->addr1;
 	k = buf->addr2;
 	next(&k);
 	n = k - buf->addr1;
 	while(ybuf.cap < n)
 		resize(&ybuf);
-	ybuf.len = 0;
-	while(ybuf.len < n)
-		((char *)ybuf.data)[ybuf.len++] = buf->c[bufaddr(j++)];
+	bytes(ybuf.data, buf->addr1, n);
+	ybuf.len = n;
 	bar("%ld bytes yanked", n);
 }
 
@@ -1200,9 +3782,7 @@ motion(int k)
 		break;
 	case Kpgup:
 	case CTRL('b'):
-		tmp = dim.ws_row - 1;
-		while(tmp-- > 0)
-			prevline(&buf->addr1);
+		lines(&buf->addr1, -(dim.ws_row - 1));
 		if(mode != Select)
 			buf->addr2 = buf->addr1;
 		buf->lead = &buf->addr1;
@@ -1210,28 +3790,19 @@ motion(int k)
 		break;
 	case Kpgdown:
 	case CTRL('f'):
-		tmp = dim.ws_row - 1;
-		while(tmp-- > 0)
-			nextline(&buf->addr2);
+		lines(&buf->addr2, dim.ws_row - 1);
 		if(mode != Select)
 			buf->addr1 = buf->addr2;
 		buf->lead = &buf->addr2;
 		checkline(1);
 		break;
 	case CTRL('D'):
-		tmp = dim.ws_row / 2;
-		while(tmp-- > 0 && buf->vstart < len() - 1){
-			nextline(&buf->vstart);
-			buf->vline++;
-		}
+		tmp = lineof((len() > 0) ? len() - 1 : 0);
+		view((buf->vline + dim.ws_row / 2 < tmp) ? buf->vline + dim.ws_row / 2 : tmp);
 		checkline(0);
 		break;
 	case CTRL('U'):
-		tmp = dim.ws_row / 2;
-		while(tmp-- > 0 && buf->vstart > 0){
-			prevline(&buf->vstart);
-			buf->vline--;
-		}
+		view((buf->vline > dim.ws_row / 2u) ? buf->vline - dim.ws_row / 2 : 0);
 		checkline(1);
 		break;
 	default:
@@ -1252,6 +3823,47 @@ encwidth(size_t a)
 	return n - a;
 }
 
+#ifdef STATS
+/* show latency statistics and buffer figures in status bar */
+void
+statbar(void)
+{
+	bar("%lu keys, p50/p99/max us: all %.0f/%.0f/%.0f, draw %.0f/%.0f/%.0f; "
+	    "%.0f bytes/frame; %zu bytes, %s %zu, %zu undo",
+	    st.keys, quantile(Pall, 0.5), quantile(Pall, 0.99), st.max[Pall] * 1e6,
+	    quantile(Pdraw, 0.5), quantile(Pdraw, 0.99), st.max[Pdraw] * 1e6,
+	    (st.frames > 0) ? (double)st.out / st.frames : 0.0, len(),
+	    (buf->kind == Gap) ? "gap" : "added", (buf->kind == Gap) ? buf->gap : buf->add.len,
+	    buf->changes.len);
+}
+#endif
+
+/* switch to buffer i, dropping it from the table if it cannot be read in */
+void
+visit(size_t i)
+{
+	char jp[PATH_MAX];
+	const char *path;
+	int e;
+
+	if(use(i) == 0){
+		bar("Current buffer [%zu/%zu]: %s", current + 1, bufs.len, buf->path);
+		return;
+	}
+	e = errno;
+	path = bufat(i)->path;
+	jpath(bufat(i), jp);
+	if(e == EEXIST)
+		bar("%s has a journal %s: restart with -r to recover it or -d to discard it", path, jp);
+	else if(e == ESTALE)
+		bar("%s has changed since its journal %s was written: restart with -d to discard it", path, jp);
+	else
+		bar("Unable to open %s", path);
+	bufdel(i);
+	if(current > i)
+		current--;
+}
+
 /* interpret key for command mode */
 void
 command(int k)
@@ -1259,14 +3871,14 @@ command(int k)
 	size_t i;
 	ssize_t r;
 	int fd;
-	char *s;
-	char tmp[5];
+	char *s, tmp[5];
 
 	if(motion(k) > 0)
 		return;
 	refresh = 1;
 	switch(k){
 	case Kesc:
+		setpat(""); /* clear highlighted matches */
 		fd = (buf->lead == &buf->addr1) ? 0 : 1;
 		buf->addr1 = buf->addr2 = *buf->lead;
 		checkline(fd);
@@ -1274,31 +3886,22 @@ command(int k)
 		bar("COMMAND");
 		break;
 	case 'b':
-		bar("Current buffer [%d/%d]: %s", current + 1, nbuf, buf->path);
+		bar("Current buffer [%zu/%zu]: %s", current + 1, bufs.len, buf->path);
 		break;
 	case 'n':
-		if(++current == nbuf)
-			current = 0;
-		buf = &bufs[current];
-		bar("Current buffer [%d/%d]: %s", current + 1, nbuf, buf->path);
+		visit((current + 1 == bufs.len) ? 0 : current + 1);
 		break;
 	case 'N':
-		current = (current == 0) ? nbuf - 1 : current - 1;
-		buf = &bufs[current];
-		bar("Current buffer [%d/%d]: %s", current + 1, nbuf, buf->path);
+		visit((current == 0) ? bufs.len - 1 : current - 1);
 		break;
 	case 'f':
-		if(nbuf == LEN(bufs))
-			bar("32 buffers already open!");
-		if(dialogue("File: ") == -1)
+		if(dialogue("File: ", NULL) == -1)
 			break;
-		if(bufinit(nbuf, dbuf.data) == -1){
+		if(bufnew(dbuf.data) == NULL){
 			bar("Unable to open %s", dbuf.data);
 			break;
 		}
-		current = ++nbuf - 1;
-		buf = &bufs[current];
-		bar("Current buffer [%d/%d]: %s", current + 1, nbuf, buf->path);
+		visit(bufs.len - 1);
 		break;
 	case 'i':
 	case Kins:
@@ -1314,7 +3917,7 @@ command(int k)
 		bar("INPUT");
 		break;
 	case 'o':
-		if(buf->c[bufaddr(buf->addr2)] != '\n')
+		if(at(buf->addr2) != '\n')
 			eol(&buf->addr2);
 		newline(&buf->addr2, 0);
 		record(Uend, 0, 0);
@@ -1324,7 +3927,7 @@ command(int k)
 		bar("INPUT");
 		break;
 	case 'O':
-		if(buf->c[bufaddr(buf->addr1)] != '\n')
+		if(at(buf->addr1) != '\n')
 			sol(&buf->addr1);
 		newline(&buf->addr1, 1);
 		record(Uend, 0, 0);
@@ -1341,7 +3944,7 @@ command(int k)
 		sol(&buf->addr1);
 		if(buf->addr1 > 0 && buf->addr1 < len() - 1)
 			next(&buf->addr1);
-		if(buf->c[bufaddr(buf->addr2)] != '\n')
+		if(at(buf->addr2) != '\n')
 			eol(&buf->addr2);
 		buf->lead = &buf->addr2;
 		mode = Select;
@@ -1357,8 +3960,7 @@ command(int k)
 			}
 			i = encwidth(buf->addr2);
 			i += (buf->addr2 - buf->addr1);
-			while(i-- > 0)
-				delete(buf->addr1, 1);
+			delete(buf->addr1, i, 1);
 			record(Uend, 0, 0);
 			buf->addr2 = buf->addr1;
 			mode = Command;
@@ -1370,12 +3972,9 @@ command(int k)
 				return;
 		}
 		memcpy(tmp, ch, 5);
-		i = encwidth(buf->addr2);
-		while(i-- > 0)
-			delete(buf->addr2, 1);
-		s = tmp;
-		while(*s)
-			insert(buf->addr2++, *s++, 1);
+		delete(buf->addr2, encwidth(buf->addr2), 1);
+		insert(buf->addr2, tmp, strlen(tmp), 1);
+		buf->addr2 += strlen(tmp);
 		record(Uend, 0, 0);
 		buf->addr1 = buf->addr2;
 		break;
@@ -1393,8 +3992,8 @@ command(int k)
 		if(ybuf.len > 0)
 			next(&buf->addr2); /* fallthrough */
 	case 'P':
-		for(i = 0; i < ybuf.len; i++)
-			insert(buf->addr2++, ((char *)ybuf.data)[i], 1);
+		insert(buf->addr2, ybuf.data, ybuf.len, 1);
+		buf->addr2 += ybuf.len;
 		record(Uend, 0, 0);
 		buf->addr1 = buf->addr2;
 		checkline(1);
@@ -1404,6 +4003,13 @@ command(int k)
 		undo(&buf->addr1, &buf->addr2);
 		checkline(buf->vstart > buf->addr1 ? 0 : 1);
 		break;
+	case CTRL('r'):
+		redo(&buf->addr1, &buf->addr2);
+		if(buf->addr2 > 0 && buf->addr2 >= len())
+			prev(&buf->addr2);
+		buf->addr1 = buf->addr2;
+		checkline(buf->vstart > buf->addr1 ? 0 : 1);
+		break;
 	case '<':
 		indent(&buf->addr1, &buf->addr2, 0);
 		break;
@@ -1417,24 +4023,37 @@ command(int k)
 		buf->lead = &buf->addr1;
 		break;
 	case 'G':
-		while(buf->addr2 < len() - 1)
-			next(&buf->addr2);
+		buf->addr2 = len();
+		prev(&buf->addr2);
 		if(mode != Select)
 			buf->addr1 = buf->addr2;
 		buf->lead = &buf->addr2;
 		checkline(1);
 		break;
+	case 'g':
+		if(dialogue("Line: ", NULL) == -1)
+			break;
+		i = strtoul(dbuf.data, &s, 10);
+		if(s == dbuf.data || *s != 0){
+			bar("Invalid line number %s", dbuf.data);
+			break;
+		}
+		buf->addr1 = linestart(i);
+		if(buf->addr1 == len())
+			prev(&buf->addr1);
+		buf->addr2 = buf->addr1;
+		buf->lead = &buf->addr1;
+		checkline(0);
+		checkline(1);
+		break;
+#ifdef STATS
+	case 'S':
+		statbar();
+		break;
+#endif
 	case CTRL('G'):
-		i = buf->addr1;
-		sol(&i);
-		if(buf->c[bufaddr(i)] == '\n' && i < len())
-			next(&i);
-		r = 0;
-		while(i < buf->addr1)
-			r += next(&i);
-		fd = checkline(1) - 1;
 		bar("Line %ld, Column %ld, %ld of %ld bytes (%.1f%%)",
-		    buf->vline + fd, r, buf->addr1, len(),
+		    lineof(buf->addr1), place(buf->addr1).col, buf->addr1, len(),
 		    (len() > 0) ? 100.0 * (buf->addr1 + 1) / len() : 0);
 		break;
 	case 't':
@@ -1460,39 +4079,56 @@ command(int k)
 		checkline(1);
 		break;
 	case 'W':
-		if(len() == 0 || buf->c[bufaddr(len() - 1)] != '\n')
-			insert(len(), '\n', 0);
-		fd = open(buf->path, O_WRONLY | O_TRUNC, 0666);
-		if(fd > 0){
-			r = writef(fd);
-			if(r > 0){
-				buf->dirty = 0;
-				bar("%ld bytes written to %s", r, buf->path);
-				close(fd);
-				return;
-			}
+		if(buf->saver != 0){
+			bar("Still writing %s", buf->path);
+			return;
 		}
-		err(Panic);
+		if(len() == 0 || at(len() - 1) != '\n')
+			insert(len(), "\n", 1, 0);
+		if(savebg() == 0){
+			if(!headless)
+				bar("Writing %s", buf->path);
+			else if(savepoll(buf, 1) == 0) /* scripts see the write finish */
+				bar("%zu bytes written to %s", buf->savelen, buf->path);
+			else
+				bar("Unable to write %s", buf->path);
+			return;
+		}
+		jflush(buf);
+		buf->savejoff = buf->jlen;
+		if((r = replacef(-1)) > 0){
+			buf->dirty = 0;
+			jrestart(buf);
+			bar("%ld bytes written to %s", r, buf->path);
+			return;
+		}
+		bar("Unable to write %s: %s", buf->path, strerror(errno));
 		break;
 	case 'q':
+		while(buf->saver != 0)
+			savepoll(buf, 1);
 		if(buf->dirty){
 			bar("Current buffer contains unsaved modifications");
 			return;
 		}
-		if(nbuf > 1){
-			buffree(buf);
-			memmove(bufs + current, bufs + current + 1,
-			        sizeof(Buffer) * (nbuf - current - 1));
+		if(bufs.len > 1){
+			jdrop(buf);
+			i = current;
+			if(use((i == 0) ? 1 : 0) == -1){
+				bar("Unable to open %s", bufat((i == 0) ? 1 : 0)->path);
+				return;
+			}
+			bufdel(i);
 			current = 0;
-			nbuf--;
-			buf = &bufs[current];
-			bar("Current buffer [%d/%d]: %s", current + 1, nbuf, buf->path);
+			bar("Current buffer [%zu/%zu]: %s", current + 1, bufs.len, buf->path);
 			break;
 		} /* fallthrough */
 	case 'Q':
-		for(i = 0; i < nbuf; i++){
-			if(bufs[i].dirty){
-				bar("Buffer %d contains unsaved modifications", i + 1);
+		for(i = 0; i < bufs.len; i++){
+			while(bufat(i)->saver != 0)
+				savepoll(bufat(i), 1);
+			if(bufat(i)->dirty){
+				bar("Buffer %zu contains unsaved modifications", i + 1);
 				return;
 			}
 		} /* fallthrough */
@@ -1509,9 +4145,10 @@ command(int k)
 void
 input(int k)
 {
-	char *s;
-	size_t a;
+	short t;
 
+	t = typing;
+	typing = 0;
 	if(motion(k) > 0)
 		return;
 	refresh = 1;
@@ -1522,35 +4159,28 @@ input(int k)
 	case Kbs:
 		if(buf->addr2 > 0){
 			prev(&buf->addr2);
-			a = encwidth(buf->addr2);
-			while(a-- > 0){
-				delete(buf->addr2, 1);
-				record(Uend, 0, 0);
-			}
+			delete(buf->addr2, encwidth(buf->addr2), 1);
+			record(Uend, 0, 0);
 			buf->addr1 = buf->addr2;
 		}
 		break;
 	case Kdel:
 		if(buf->addr2 < len()){
-			a = encwidth(buf->addr2);
-			while(a-- > 0){
-				delete(buf->addr2, 1);
-				record(Uend, 0, 0);
-			}
+			delete(buf->addr2, encwidth(buf->addr2), 1);
+			record(Uend, 0, 0);
 		}
 		break;
 	case Kesc:
 		if(buf->addr2 > len() - 1)
-			buf->addr2--;
+			prev(&buf->addr2);
 		buf->addr1 = buf->addr2;
 		checkline(1);
 		mode = Command;
 		bar("COMMAND");
 		break;
 	case '\t':
-		k = tabspace;
-		while(k-- > 0)
-			insert(buf->addr2++, usetabs ? '\t' : ' ', 1);
+		fill(buf->addr2, usetabs ? '\t' : ' ', tabspace, 1);
+		buf->addr2 += tabspace;
 		record(Uend, 0, 0);
 		buf->addr1 = buf->addr2;
 		break;
@@ -1560,58 +4190,187 @@ input(int k)
 		buf->addr1 = buf->addr2;
 		checkline(1);
 		break;
+	case Kpaste: /* as is, without autoindent */
+		insert(buf->addr2, kbuf.data, kbuf.len, 1);
+		buf->addr2 += kbuf.len;
+		record(Uend, 0, 0);
+		buf->addr1 = buf->addr2;
+		checkline(1);
+		break;
 	default:
-		s = ch;
-		while(*s)
-			insert(buf->addr2++, *s++, 1);
+		if(t)
+			reopen(buf->addr2); /* undo a run of typing at once */
+		insert(buf->addr2, ch, strlen(ch), 1);
+		buf->addr2 += strlen(ch);
 		record(Uend, 0, 0);
+		typing = 1;
 		buf->addr1 = buf->addr2;
 		checkline(1);
 		break;
 	}
 }
 
+/* report on buffer's background save */
+void
+saveshow(Buffer *b)
+{
+	double t;
+	int r;
+
+	r = savepoll(b, 0);
+	t = now() - b->savet;
+	if(r == 1)
+		bar("Writing %s: %.0f%% at %.0f MB/s", b->path,
+		    100.0 * b->saved / b->savelen, b->saved / 1e6 / t);
+	else if(r == 0)
+		bar("%zu bytes written to %s in %.2fs", b->savelen, b->path, t);
+	else
+		bar("Unable to write %s", b->path);
+}
+
+/* wait for input while any background saves run or journals are to be
+ * synced, seeing to them; returns whether any were seen to before a key arrived */
+int
+follow(void)
+{
+	struct pollfd *p;
+	size_t i, n;
+	double t, d;
+	int r;
+
+	while(pfds.cap < bufs.len + 1)
+		resize(&pfds);
+	p = pfds.data;
+	p[0].fd = keyfd;
+	p[0].events = POLLIN;
+	for(i = 0, n = 1, t = -1; i < bufs.len; i++){
+		if(bufat(i)->saver != 0){
+			p[n].fd = bufat(i)->savefd;
+			p[n++].events = POLLIN;
+		}
+		if((d = jsync(bufat(i), 0)) > 0 && (t < 0 || d < t))
+			t = d;
+	}
+	if((n == 1 && t < 0) || headless || ringr != ringw)
+		return 0;
+	if((r = poll(p, n, (t < 0) ? -1 : (int)(t * 1000) + 1)) == 0)
+		return 1; /* a journal is due to be synced */
+	if(r < 0 || p[0].revents != 0)
+		return 0;
+	for(i = 0, n = 1; i < bufs.len; i++){
+		if(bufat(i)->saver != 0 && p[n++].revents != 0)
+			saveshow(bufat(i));
+	}
+	refresh = 1; /* put cursor back */
+	return 1;
+}
+
 /* editor event loop */
 void
 run(void)
 {
+	size_t i;
 	int k;
 
 	if(dims() == -1)
 		err(Panic);
+	repaint = 1;
 	while(!quit){
-		if(refresh){
+		if(refresh && !pending()){ /* draw only once queued keys are handled */
 			display();
+			TALLY(Pdraw);
 			refresh = 0;
 		}
+		if(!pending()){
+			for(i = 0; i < bufs.len; i++)
+				jflush(bufat(i));
+		}
+		if(follow())
+			continue;
+		TALLYKEY();
 		k = key();
+		TALLY(Pkey);
 		if(mode == Input)
 			input(k);
 		else
 			command(k);
+		TALLY(Pcmd);
 	}
 }
 
 int
 main(int argc, char **argv)
 {
-	if(argc < 2){
-		fprintf(stderr, "er (0.6.1)\nUsage:\n\ter file...\n");
+	int c;
+	size_t i;
+	unsigned int x, y;
+
+	dim.ws_col = 80;
+	dim.ws_row = 24;
+	while((c = getopt(argc, argv, "dg:m:rs:u:y:")) != -1){
+		switch(c){
+		case 'g':
+			if(sscanf(optarg, "%ux%u", &x, &y) != 2 ||
+			   x < 4 || y < 2 || x > 1024 || y > 1024)
+				goto Usage;
+			dim.ws_col = x;
+			dim.ws_row = y;
+			break;
+		case 'm':
+			bufmax = strtoul(optarg, NULL, 10) << 10;
+			break;
+		case 'd':
+			discard = 1;
+			break;
+		case 'r':
+			recover = 1;
+			break;
+		case 's':
+			headless = 1;
+			if(strcmp(optarg, "-") != 0 && (keyfd = open(optarg, O_RDONLY)) == -1){
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		case 'u':
+			undomax = strtoul(optarg, NULL, 10) << 10;
+			break;
+		case 'y':
+			fsyncs = atoi(optarg);
+			break;
+		default:
+			goto Usage;
+		}
+	}
+	if(optind >= argc){
+	Usage:
+		fprintf(stderr, "er (0.6.1)\nUsage:\n\ter [-r | -d] [-m kbytes] [-u kbytes] [-y fsync] [-s script [-g colsxrows]] file...\n");
 		exit(1);
 	}
-	nbuf = argc - 1;
 	if(sigsetjmp(env, 1) == 0)
-		 init(nbuf, argv);
-	buf = &bufs[current];
+		 init(argc - optind, argv + optind);
+	buf = bufat(current);
         mode = Command;
 	refresh = usetabs = tabspace = autoindent =  1;
-	if(status != Panic)
-		run();
-	else
+	if(status == Panic)
 		save();
+	else if(status != Eof)
+		run();
+	c = 0;
+	if(status == Eof){ /* script ended without quitting */
+		for(i = 0; i < bufs.len && c == 0; i++){
+			if(bufat(i)->dirty){
+				fprintf(stderr, "er: unsaved changes to %s\n", bufat(i)->path);
+				c = 1;
+			}
+		}
+	}
 	end();
-	if(status == Panic)
+	if(status == Panic){
+		c = 2;
 		fprintf(stderr,
-		        "er panicked and tried to save buffer(s) to er.out!\n");
-	return 0;
+		        "er panicked! Unsaved changes can be recovered with er -r,\n"
+		        "or else were saved to er.out.\n");
+	}
+	return c;
 }
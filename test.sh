@@ -0,0 +1,39 @@
+#!/bin/sh
+# script-mode tests: each key script is run on the same text with both
+# storage engines (er and erpieces), which must leave the expected file
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# check name text keys expected
+check()
+{
+	for e in er erpieces; do
+		printf "$2" > "$dir/$e"
+		printf "$3" > "$dir/keys"
+		(cd "$dir" && "$OLDPWD/$e" -s keys "$e" > /dev/null)
+		if [ "$(cat "$dir/$e")" != "$(printf "$4")" ]; then
+			echo "FAIL: $1 ($e)"
+			fail=1
+		fi
+	done
+}
+
+check "search skips empty matches" 'abc\nbbx\n' 'sb*\nxW' 'ac\nbbx\n'
+check "replace skips empty matches" 'abc\nbbx\n' 'mb*\n\177\177Z\nW' 'aZc\nbbx\n'
+check "search finds no non-empty match" 'acd\n' 'sb*\nxW' 'cd\n'
+
+# a stale journal refuses the file until -d discards it
+printf 'abc\n' > "$dir/f"
+printf 'stale' > "$dir/.f.erj"
+printf 'xW' > "$dir/keys"
+if (cd "$dir" && "$OLDPWD/er" -s keys f > /dev/null 2>&1) ||
+   ! (cd "$dir" && "$OLDPWD/er" -d -s keys f > /dev/null) ||
+   [ -e "$dir/.f.erj" ] || [ "$(cat "$dir/f")" != bc ]; then
+	echo "FAIL: -d discards a stale journal"
+	fail=1
+fi
+
+[ $fail = 0 ] && echo "all tests passed"
+exit $fail